@@ -0,0 +1,290 @@
+#include "Capture.hpp"
+#include "CaseMap.hpp"
+#include "IrcMessage.hpp"
+#include "Metrics.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char MAGIC[] = "IRCCAP1\n";
+
+Capture::Capture()
+: _fd(-1), _anonymize(false), _startNs(0), _salt(0)
+{
+    pthread_mutex_init(&_lock, 0);
+}
+
+Capture::~Capture()
+{
+    if (_fd >= 0)
+        ::close(_fd);
+    pthread_mutex_destroy(&_lock);
+}
+
+void Capture::open(const std::string &path, bool anonymize)
+{
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (_fd < 0)
+        throw std::runtime_error("capture: cannot open " + path + ": " + std::strerror(errno));
+    _anonymize = anonymize;
+    _startNs = Metrics::monotonicNs();
+    _salt = _startNs ^ ((unsigned long)getpid() << 32);
+    write(std::string(MAGIC, sizeof(MAGIC) - 1));
+}
+
+void Capture::resume(const std::string &path, bool anonymize,
+                     unsigned long startNs, unsigned long salt)
+{
+    _fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (_fd < 0)
+        throw std::runtime_error("capture: cannot reopen " + path + ": " + std::strerror(errno));
+    _anonymize = anonymize;
+    _startNs = startNs;
+    _salt = salt;
+}
+
+unsigned long Capture::elapsedUs() const
+{
+    return (Metrics::monotonicNs() - _startNs) / 1000;
+}
+
+void Capture::write(const std::string &records)
+{
+    pthread_mutex_lock(&_lock);
+    size_t off = 0;
+    while (_fd >= 0 && off < records.size())
+    {
+        ssize_t n = ::write(_fd, records.data() + off, records.size() - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            std::cout << "[Server] Capture write failed: " << std::strerror(errno)
+                      << ", capture stopped" << std::endl;
+            ::close(_fd);
+            _fd = -1;
+            break;
+        }
+        off += (size_t)n;
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+// FNV-1a over the casefolded bytes, so Alice and alice hash alike.
+static unsigned long hashBytes(const char *p, size_t n, unsigned long salt)
+{
+    unsigned long h = 14695981039346656037UL ^ salt;
+    for (size_t i = 0; i < n; ++i)
+    {
+        h ^= (unsigned char)ircToLower(p[i]);
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static void appendName(const Slice &name, unsigned long salt, std::string &out)
+{
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "n%08lx", hashBytes(name.data, name.len, salt) & 0xffffffffUL);
+    out += buf;
+}
+
+// Comma separated names: channels and numbers are kept, the rest hashed.
+static void appendNames(const Slice &list, unsigned long salt, std::string &out)
+{
+    const char *p = list.data;
+    const char *end = list.data + list.len;
+    while (p <= end)
+    {
+        const char *comma = static_cast<const char*>(std::memchr(p, ',', end - p));
+        if (!comma)
+            comma = end;
+        Slice item(p, comma - p);
+        bool digits = !item.empty();
+        for (size_t i = 0; i < item.len && digits; ++i)
+            digits = item[i] >= '0' && item[i] <= '9';
+        if (item.empty() || item[0] == '#' || item[0] == '&' || item[0] == '+'
+            || item[0] == '-' || digits)
+            out.append(item.data, item.len);
+        else
+            appendName(item, salt, out);
+        if (comma == end)
+            break;
+        out += ',';
+        p = comma + 1;
+    }
+}
+
+// Same length and word breaks, letters drawn from a hash of the text.
+static void appendText(const Slice &text, unsigned long salt, std::string &out)
+{
+    unsigned long x = hashBytes(text.data, text.len, salt) | 1;
+    for (size_t i = 0; i < text.len; ++i)
+    {
+        if (text[i] == ' ')
+        {
+            out += ' ';
+            continue;
+        }
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        out += (char)('a' + x % 26);
+    }
+}
+
+// Per-parameter treatment; the last letter covers any further params.
+// n: name list, t: free text, s: secret, k: keep, m: mode argument
+// (a secret when the mode string touches the key, names otherwise).
+struct AnonRule
+{
+    const char *command;
+    const char *params;
+};
+
+static const AnonRule s_rules[] = {
+    { "PASS", "s" },
+    { "NICK", "n" },
+    { "USER", "nkkt" },
+    { "OPER", "ns" },
+    { "PRIVMSG", "nt" },
+    { "NOTICE", "nt" },
+    { "JOIN", "ns" },
+    { "PART", "kt" },
+    { "QUIT", "t" },
+    { "TOPIC", "kt" },
+    { "KICK", "knt" },
+    { "INVITE", "n" },
+    { "MODE", "kkm" },
+    { "WHO", "n" },
+    { "NAMES", "n" }
+};
+
+static const char *rulesFor(const Slice &command)
+{
+    for (size_t i = 0; i < sizeof(s_rules) / sizeof(s_rules[0]); ++i)
+    {
+        const char *name = s_rules[i].command;
+        if (std::strlen(name) != command.len)
+            continue;
+        size_t j = 0;
+        while (j < command.len && (command[j] & ~0x20) == name[j])
+            ++j;
+        if (j == command.len)
+            return s_rules[i].params;
+    }
+    return "k";
+}
+
+bool Capture::anonymize(const Slice &line, std::string &out) const
+{
+    IrcMessage msg;
+    if (!parseMessage(line, msg))
+        return false;
+
+    out.append(msg.command.data, msg.command.len);
+    const char *rules = rulesFor(msg.command);
+    size_t last = std::strlen(rules) - 1;
+    for (size_t i = 0; i < msg.paramCount; ++i)
+    {
+        out += ' ';
+        if (i + 1 == msg.paramCount && msg.hasTrailing)
+            out += ':';
+        const Slice &p = msg.params[i];
+        switch (rules[i < last ? i : last])
+        {
+            case 'n': appendNames(p, _salt, out); break;
+            case 't': appendText(p, _salt, out); break;
+            case 's': out += '*'; break;
+            case 'm':
+                if (msg.paramCount > 1 && std::memchr(msg.params[1].data, 'k', msg.params[1].len))
+                    out += '*';
+                else
+                    appendNames(p, _salt, out);
+                break;
+            default: out.append(p.data, p.len); break;
+        }
+    }
+    return true;
+}
+
+CaptureWriter::CaptureWriter()
+: _capture(0), _lastFlush(0)
+{}
+
+CaptureWriter::~CaptureWriter()
+{
+    flush();
+}
+
+void CaptureWriter::attach(Capture *capture)
+{
+    _capture = capture;
+}
+
+static void appendVarint(std::string &out, unsigned long v)
+{
+    while (v >= 0x80)
+    {
+        out += (char)(v | 0x80);
+        v >>= 7;
+    }
+    out += (char)v;
+}
+
+void CaptureWriter::record(int type, unsigned long id)
+{
+    _buf += (char)type;
+    appendVarint(_buf, _capture->elapsedUs());
+    appendVarint(_buf, id);
+}
+
+void CaptureWriter::connect(unsigned long id)
+{
+    record(Capture::TYPE_CONNECT, id);
+}
+
+void CaptureWriter::line(unsigned long id, const Slice &line)
+{
+    Slice payload = line;
+    if (_capture->anonymized())
+    {
+        _scratch.clear();
+        if (!_capture->anonymize(line, _scratch))
+            return;
+        payload = Slice(_scratch);
+    }
+    record(Capture::TYPE_LINE, id);
+    appendVarint(_buf, payload.len);
+    _buf.append(payload.data, payload.len);
+    if (_buf.size() >= FLUSH_BYTES)
+        flush();
+}
+
+void CaptureWriter::close(unsigned long id)
+{
+    record(Capture::TYPE_CLOSE, id);
+}
+
+void CaptureWriter::maybeFlush(unsigned long nowMs)
+{
+    if (_buf.empty())
+        _lastFlush = nowMs;
+    else if (nowMs - _lastFlush >= FLUSH_MS)
+    {
+        flush();
+        _lastFlush = nowMs;
+    }
+}
+
+void CaptureWriter::flush()
+{
+    if (!_capture || _buf.empty())
+        return;
+    _capture->write(_buf);
+    _buf.clear();
+}
@@ -0,0 +1,95 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <string>
+#include <pthread.h>
+#include "Slice.hpp"
+
+// Traffic capture for load replay (bench/ircreplay). The file starts with
+// the 8 byte magic "IRCCAP1\n", followed by records
+//
+//   u8 type, varint usec, varint connection id [, varint length, bytes]
+//
+// where usec counts from when the capture was opened, varints are LEB128
+// and only TYPE_LINE carries a payload (the line without CRLF). Loops
+// append whole buffers of records, so the file is ordered per connection
+// but not globally; readers sort by time.
+class Capture
+{
+    private:
+        int _fd;
+        bool _anonymize;
+        unsigned long _startNs;
+        unsigned long _salt;
+        pthread_mutex_t _lock;
+
+        Capture(const Capture &);
+        Capture &operator=(const Capture &);
+
+    public:
+        enum
+        {
+            TYPE_CONNECT = 1,
+            TYPE_LINE = 2,
+            TYPE_CLOSE = 3
+        };
+
+        Capture();
+        ~Capture();
+
+        void open(const std::string &path, bool anonymize);
+        // Continues a capture started by the process that handed over to
+        // this one: appends, and keeps its clock and hash salt.
+        void resume(const std::string &path, bool anonymize,
+                    unsigned long startNs, unsigned long salt);
+        bool isOpen() const { return _fd >= 0; }
+        bool anonymized() const { return _anonymize; }
+        unsigned long startNs() const { return _startNs; }
+        unsigned long salt() const { return _salt; }
+        unsigned long elapsedUs() const;
+        void write(const std::string &records);
+
+        // Rewrites a client line with nicknames, keys and free text
+        // replaced by hashes salted per capture, so names stay consistent
+        // within one file; channel names and text lengths are kept.
+        // Returns false for unparseable lines.
+        bool anonymize(const Slice &line, std::string &out) const;
+};
+
+// One loop's record buffer, written to the shared capture in large
+// chunks.
+class CaptureWriter
+{
+    private:
+        Capture *_capture;
+        std::string _buf;
+        std::string _scratch;
+        unsigned long _lastFlush;
+
+        CaptureWriter(const CaptureWriter &);
+        CaptureWriter &operator=(const CaptureWriter &);
+
+        void record(int type, unsigned long id);
+
+    public:
+        enum
+        {
+            FLUSH_BYTES = 64 * 1024,
+            FLUSH_MS = 1000
+        };
+
+        CaptureWriter();
+        ~CaptureWriter();
+
+        void attach(Capture *capture);
+        bool enabled() const { return _capture != 0; }
+
+        void connect(unsigned long id);
+        void line(unsigned long id, const Slice &line);
+        void close(unsigned long id);
+
+        void maybeFlush(unsigned long nowMs);
+        void flush();
+};
+
+#endif
@@ -0,0 +1,49 @@
+#include "CaseMap.hpp"
+
+char ircToLower(char c)
+{
+    if (c >= 'A' && c <= '^')
+        return (char)(c + ('a' - 'A'));
+    return c;
+}
+
+size_t foldedHash(const char *s, size_t len)
+{
+    size_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)ircToLower(s[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+bool foldedEquals(const std::string &folded, const char *s, size_t len)
+{
+    if (folded.size() != len)
+        return false;
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (folded[i] != ircToLower(s[i]))
+            return false;
+    }
+    return true;
+}
+
+FoldedName::FoldedName()
+: _key(""), _hash(foldedHash("", 0))
+{}
+
+FoldedName::FoldedName(const std::string &name)
+: _key(""), _hash(0)
+{
+    assign(name);
+}
+
+void FoldedName::assign(const std::string &name)
+{
+    _key.resize(name.size());
+    for (size_t i = 0; i < name.size(); ++i)
+        _key[i] = ircToLower(name[i]);
+    _hash = foldedHash(name.data(), name.size());
+}
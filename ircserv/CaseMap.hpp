@@ -0,0 +1,30 @@
+#ifndef CASEMAP_HPP
+#define CASEMAP_HPP
+
+#include <string>
+#include <cstddef>
+
+// RFC 1459 casemapping: A-Z fold to a-z and []\^ fold to {}|~.
+char ircToLower(char c);
+size_t foldedHash(const char *s, size_t len);
+bool foldedEquals(const std::string &folded, const char *s, size_t len);
+
+// A name folded once and kept next to its hash, so index lookups never
+// have to fold or hash the stored side again.
+class FoldedName
+{
+    private:
+        std::string _key;
+        size_t _hash;
+
+    public:
+        FoldedName();
+        explicit FoldedName(const std::string &name);
+
+        void assign(const std::string &name);
+        const std::string &key() const { return _key; }
+        size_t hash() const { return _hash; }
+        bool empty() const { return _key.empty(); }
+};
+
+#endif
@@ -1,23 +1,58 @@
 #include "Channel.hpp"
+#include "Metrics.hpp"
 #include <sys/socket.h>
 #include <string>
+#include <algorithm>
 
 Channel::Channel(const std::string &name)
 :   _name(name),
+    _foldedName(name),
     _topic(""),
     _key(""),
     _limit(0),
     _inviteOnly(false),
-    _topicRestricted(false)
+    _topicRestricted(false),
+    _repliesValid(false)
 {}
 
-Channel::~Channel() {}
+Channel::~Channel()
+{
+    const Membership *m = _members.members();
+    for (size_t i = 0; i < _members.entryCount(); ++i)
+    {
+        if (m[i].modes & MemberTable::MEMBER)
+            m[i].client->removeChannel(this);
+        if (m[i].modes & MemberTable::INVITED)
+            m[i].client->removeInvite(this);
+    }
+}
+
+Pool &Channel::pool()
+{
+    static Pool pool("channel", sizeof(Channel), 256);
+    return pool;
+}
+
+void *Channel::operator new(size_t)
+{
+    return pool().allocate();
+}
+
+void Channel::operator delete(void *p)
+{
+    pool().release(p);
+}
 
 const std::string &Channel::getName() const
 { 
     return _name;
 }
 
+const FoldedName &Channel::foldedName() const
+{
+    return _foldedName;
+}
+
 const std::string &Channel::getTopic() const
 {
     return _topic;
@@ -70,72 +105,215 @@ bool Channel::isTopicRestricted() const
 
 bool Channel::addClient(Client *c)
 {
-    if (_clients.find(c) != _clients.end())
+    bool invited = isInvited(c);
+    if (!_members.join(c))
         return true;
 
-    _clients.insert(c);
-    removeInvitation(c);
-    if (_operators.empty())
-        _operators.insert(c);
+    if (invited)
+        c->removeInvite(this);
+    c->addChannel(this);
+    bool saved = false;
+    for (size_t i = 0; i < _savedOps.size() && !saved; ++i)
+    {
+        if (_savedOps[i] == c->foldedName().key())
+        {
+            _savedOps.erase(_savedOps.begin() + i);
+            saved = true;
+        }
+    }
+    if (saved || (_members.opCount() == 0 && _savedOps.empty()))
+        _members.set(c, MemberTable::OP);
+    if (_repliesValid)
+        appendReplies(c);
     return true;
 }
 
 void Channel::removeClient(Client *c)
 {
-    _clients.erase(c);
-    _operators.erase(c);
+    if (_members.part(c))
+    {
+        c->removeChannel(this);
+        _repliesValid = false;
+    }
 }
 
 bool Channel::hasClient(Client *c) const
 {
-    return _clients.count(c) > 0;
+    return (_members.modes(c) & MemberTable::MEMBER) != 0;
+}
+
+size_t Channel::memberCount() const
+{
+    return _members.memberCount();
+}
+
+const Membership *Channel::members() const
+{
+    return _members.members();
 }
 
-const std::set<Client*>& Channel::getClients() const
+size_t Channel::entryCount() const
 {
-    return _clients;
+    return _members.entryCount();
+}
+
+void Channel::restoreEntry(Client *c, unsigned int modes)
+{
+    if ((modes & MemberTable::MEMBER) && _members.join(c))
+        c->addChannel(this);
+    _members.set(c, modes);
+    if (modes & MemberTable::INVITED)
+        c->addInvite(this);
+    _repliesValid = false;
 }
 
 void Channel::addOperator(Client *c)
 {
-    _operators.insert(c);
+    if (hasClient(c) && _members.set(c, MemberTable::OP))
+        _repliesValid = false;
 }
 
 void Channel::removeOperator(Client *c)
 {
-    _operators.erase(c);
+    if (_members.clear(c, MemberTable::OP))
+        _repliesValid = false;
 }
 
 bool Channel::isOperator(Client *c) const
 {
-    return _operators.count(c) > 0;
+    return (_members.modes(c) & MemberTable::OP) != 0;
+}
+
+void Channel::addVoice(Client *c)
+{
+    if (hasClient(c) && _members.set(c, MemberTable::VOICE))
+        _repliesValid = false;
+}
+
+void Channel::removeVoice(Client *c)
+{
+    if (_members.clear(c, MemberTable::VOICE))
+        _repliesValid = false;
+}
+
+bool Channel::isVoiced(Client *c) const
+{
+    return (_members.modes(c) & MemberTable::VOICE) != 0;
+}
+
+void Channel::addSavedOperator(const std::string &nick)
+{
+    std::string key = FoldedName(nick).key();
+    if (!key.empty() && std::find(_savedOps.begin(), _savedOps.end(), key) == _savedOps.end())
+        _savedOps.push_back(key);
+}
+
+bool Channel::isSavedOperator(const Client *c) const
+{
+    return std::find(_savedOps.begin(), _savedOps.end(), c->foldedName().key()) != _savedOps.end();
+}
+
+const std::vector<std::string> &Channel::savedOperators() const
+{
+    return _savedOps;
+}
+
+void Channel::appendReplies(Client *c)
+{
+    std::string nick = c->getNickname().empty() ? "anon" : c->getNickname();
+    std::string user = c->getUsername().empty() ? "user" : c->getUsername();
+    unsigned int modes = _members.modes(c);
+    const char *prefix = (modes & MemberTable::OP) ? "@" : (modes & MemberTable::VOICE) ? "+" : "";
+
+    size_t header = (sizeof(":ircserv 353 ") - 1) + Client::NICKLEN + (sizeof(" = ") - 1)
+                  + _name.size() + (sizeof(" :\r\n") - 1);
+    size_t budget = header < 512 ? 512 - header : 0;
+    size_t len = nick.size() + (*prefix ? 1 : 0);
+    if (_namesBlocks.empty() || _namesBlocks.back().size() + 1 + len > budget)
+        _namesBlocks.push_back(std::string());
+    std::string &block = _namesBlocks.back();
+    if (!block.empty())
+        block += ' ';
+    block += prefix;
+    block += nick;
+
+    _whoLines.push_back(_name + " " + user + " localhost ircserv " + nick
+                        + " H" + prefix + " :0 " + nick + "\r\n");
+}
+
+const std::vector<std::string> &Channel::namesBlocks()
+{
+    if (!_repliesValid)
+    {
+        _namesBlocks.clear();
+        _whoLines.clear();
+        _repliesValid = true;
+        const Membership *m = _members.members();
+        for (size_t i = 0; i < _members.memberCount(); ++i)
+            appendReplies(m[i].client);
+    }
+    return _namesBlocks;
+}
+
+const std::vector<std::string> &Channel::whoLines()
+{
+    namesBlocks();
+    return _whoLines;
+}
+
+void Channel::invalidateReplies()
+{
+    _repliesValid = false;
 }
 
 void Channel::invite(Client *c)
 {
-    _invited.insert(c);
+    if (_members.set(c, MemberTable::INVITED))
+        c->addInvite(this);
 }
 
 bool Channel::isInvited(Client *c) const
 {
-    return _invited.count(c) > 0;
+    return (_members.modes(c) & MemberTable::INVITED) != 0;
 }
 
 void Channel::removeInvitation(Client *c)
 {
-    _invited.erase(c);
+    if (_members.clear(c, MemberTable::INVITED))
+        c->removeInvite(this);
 }
 
-void Channel::broadcast(Client *sender, const std::string &message)
+void Channel::broadcast(const SharedBuffer &message, Client *except, int priority) const
 {
-    std::set<Client*>::const_iterator it = _clients.begin();
-    for (; it != _clients.end(); ++it)
+    unsigned long recipients = 0;
+    const Membership *m = _members.members();
+    size_t n = _members.memberCount();
+    for (size_t i = 0; i < n; ++i)
     {
-        Client *c = *it;
-        if (c == sender)
-            continue;
+        if (m[i].client != except)
+        {
+            m[i].client->queueFanout(message, priority);
+            ++recipients;
+        }
+    }
+    if (Metrics *m = Metrics::current())
+        m->fanout.observe(recipients);
+}
 
-        std::string raw = ":" + sender->getNickname() + " PRIVMSG " + _name + " :" + message + "\r\n";
-        c->queueSend(raw);
+void Channel::broadcastOnce(const SharedBuffer &message, unsigned long stamp,
+                            Client *except, int priority) const
+{
+    unsigned long recipients = 0;
+    const Membership *m = _members.members();
+    size_t n = _members.memberCount();
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (m[i].client != except && m[i].client->claimFanout(stamp))
+        {
+            m[i].client->queueFanout(message, priority);
+            ++recipients;
+        }
     }
+    if (Metrics *m = Metrics::current())
+        m->fanout.observe(recipients);
 }
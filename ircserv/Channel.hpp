@@ -2,26 +2,44 @@
 #define CHANNEL_HPP
 
 #include <string>
-#include <set>
+#include <vector>
 #include "Client.hpp"
+#include "CaseMap.hpp"
+#include "MemberTable.hpp"
+#include "Pool.hpp"
 
 class Channel
 {
     private:
         std::string _name;
+        FoldedName _foldedName;
         std::string _topic;
         std::string _key;
         size_t _limit;
         bool _inviteOnly;
         bool _topicRestricted;
-        std::set<Client*> _clients;
-        std::set<Client*> _operators;
-        std::set<Client*> _invited;
+        MemberTable _members;
+        // Casefolded nicks of operators restored from a snapshot; each is
+        // opped when it joins again.
+        std::vector<std::string> _savedOps;
+
+        // NAMES and WHO replies without their per-requester header, kept
+        // until membership, operator status or a member's names change.
+        std::vector<std::string> _namesBlocks;
+        std::vector<std::string> _whoLines;
+        bool _repliesValid;
+
+        void appendReplies(Client *c);
     public:
         Channel(const std::string &name);
         ~Channel();
 
+        static void *operator new(size_t size);
+        static void operator delete(void *p);
+        static Pool &pool();
+
         const std::string &getName() const;
+        const FoldedName &foldedName() const;
         const std::string &getTopic() const;
         void setTopic(const std::string &topic);
 
@@ -37,17 +55,41 @@ class Channel
         bool addClient(Client *c);
         void removeClient(Client *c);
         bool hasClient(Client *c) const;
-        const std::set<Client*>& getClients() const;
+        size_t memberCount() const;
+        const Membership *members() const;
+        size_t entryCount() const;
+        // Puts an entry back exactly as it was, for a hot upgrade.
+        void restoreEntry(Client *c, unsigned int modes);
 
+        // Operator and voice status only apply to current members.
         void addOperator(Client *c);
         void removeOperator(Client *c);
         bool isOperator(Client *c) const;
+        void addVoice(Client *c);
+        void removeVoice(Client *c);
+        bool isVoiced(Client *c) const;
+        void addSavedOperator(const std::string &nick);
+        bool isSavedOperator(const Client *c) const;
+        const std::vector<std::string> &savedOperators() const;
+
+        // 353 parameter blocks, each split so that the header
+        // ":ircserv 353 <nick> = <channel> :" plus the block fits in 512
+        // bytes with CRLF for any nick up to Client::NICKLEN, and 352 line
+        // tails from the channel name on, CRLF included.
+        const std::vector<std::string> &namesBlocks();
+        const std::vector<std::string> &whoLines();
+        void invalidateReplies();
 
         void invite(Client *c);
         bool isInvited(Client *c) const;
         void removeInvitation(Client *c);
 
-        void broadcast(Client *sender, const std::string &message);
+        void broadcast(const SharedBuffer &message, Client *except = 0,
+                       int priority = Client::SEND_NORMAL) const;
+        // Skips members that already claimed stamp, so a message sent
+        // through several targets reaches each client once.
+        void broadcastOnce(const SharedBuffer &message, unsigned long stamp,
+                           Client *except, int priority) const;
 };
 
 #endif
@@ -1,33 +1,105 @@
 #include "Client.hpp"
-#include "Server.hpp"
+#include "EventLoop.hpp"
+#include "Channel.hpp"
 #include <cstddef>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <cstring>
+#include <iostream>
 
-Client::Client(int fd)
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+static const int FLUSH_IOV = 64;
+
+Client::Client(int fd, EventLoop *loop, unsigned long id)
 : _fd(fd),
+  _loop(loop),
+  _id(id),
   _nickname(""),
+  _foldedNick(),
   _username(""),
-  _buffer(""),
   _authenticated(false),
   _pass_ok(false),
   _registered(false),
-  _outbox("")
+  _oper(false),
+  _outOffset(0),
+  _dirty(false),
+  _fanoutStamp(0),
+  _class(0),
+  _queued(0),
+  _dropped(0),
+  _slow(false),
+  _closing(false),
+  _floodClock(0),
+  _parked(false),
+  _lastActive(0),
+  _pingSentAt(0)
 {}
 
-Client::~Client() {}
+Client::~Client()
+{
+    setQueued(0);
+}
+
+// Keeps the owning loop's send-queue gauge in step with this client.
+void Client::setQueued(size_t bytes)
+{
+    if (_loop)
+    {
+        Metrics &m = _loop->metrics();
+        if (bytes > _queued)
+            Metrics::add(m.sendqBytes, bytes - _queued);
+        else
+            Metrics::sub(m.sendqBytes, _queued - bytes);
+    }
+    __atomic_store_n(&_queued, bytes, __ATOMIC_RELAXED);
+}
+
+Pool &Client::pool()
+{
+    static Pool pool("client", sizeof(Client), 64);
+    return pool;
+}
+
+void *Client::operator new(size_t)
+{
+    return pool().allocate();
+}
+
+void Client::operator delete(void *p)
+{
+    pool().release(p);
+}
 
 int Client::getFd() const
 {
     return _fd;
 }
 
+EventLoop *Client::getLoop() const
+{
+    return _loop;
+}
+
+unsigned long Client::getId() const
+{
+    return _id;
+}
+
 const std::string &Client::getNickname() const
 {
     return _nickname;
 }
 
+const FoldedName &Client::foldedName() const
+{
+    return _foldedNick;
+}
+
 const std::string &Client::getUsername() const
 {
     return _username;
@@ -36,11 +108,20 @@ const std::string &Client::getUsername() const
 void Client::setNickname(const std::string &nick)
 {
     _nickname = nick;
+    _foldedNick.assign(nick);
+    invalidateChannelReplies();
 }
 
 void Client::setUsername(const std::string &user)
 {
     _username = user;
+    invalidateChannelReplies();
+}
+
+void Client::invalidateChannelReplies()
+{
+    for (ChannelSet::iterator it = _channels.begin(); it != _channels.end(); ++it)
+        (*it)->invalidateReplies();
 }
 
 bool Client::isAuthenticated() const
@@ -51,25 +132,17 @@ bool Client::isAuthenticated() const
 void Client::authenticate()
 {
     _authenticated = true;
+    _registerTimer.cancel();
 }
 
-void Client::appendToBuffer(const std::string &data)
+InputBuffer &Client::getInput()
 {
-    _buffer += data;
+    return _input;
 }
 
-std::string Client::extractLine()
+InputBuffer::LineStatus Client::extractLine(Slice &line)
 {
-    std::string::size_type pos = _buffer.find('\n');
-    if (pos == std::string::npos)
-        return "";
-    
-    std::string line = _buffer.substr(0, pos);
-    if (!line.empty() && line[line.size()-1] == '\r')
-        line.erase(line.size()-1);
-    _buffer.erase(0, pos + 1);
-    
-    return line;
+    return _input.nextLine(line);
 }
 
 void Client::setPassOk(bool v)
@@ -92,10 +165,173 @@ bool Client::isRegistered() const
     return _registered;
 }
 
+void Client::setOper(bool v)
+{
+    _oper = v;
+}
+
+bool Client::isOper() const
+{
+    return _oper;
+}
+
+void Client::addChannel(Channel *ch)
+{
+    _channels.insert(ch);
+}
+
+void Client::removeChannel(Channel *ch)
+{
+    _channels.erase(ch);
+}
+
+const ChannelSet& Client::getChannels() const
+{
+    return _channels;
+}
+
+void Client::addInvite(Channel *ch)
+{
+    _invites.insert(ch);
+}
+
+void Client::removeInvite(Channel *ch)
+{
+    _invites.erase(ch);
+}
+
+const ChannelSet& Client::getInvites() const
+{
+    return _invites;
+}
+
+bool Client::claimFanout(unsigned long stamp)
+{
+    if (_fanoutStamp == stamp)
+        return false;
+    _fanoutStamp = stamp;
+    return true;
+}
+
+unsigned long Client::nextFanoutStamp()
+{
+    static unsigned long stamp = 0;
+    return ++stamp;
+}
+
+void Client::setClass(const ConnClass *cls)
+{
+    _class = cls;
+}
+
+const ConnClass *Client::getClass() const
+{
+    return _class;
+}
+
+size_t Client::sendQueueBytes() const
+{
+    return __atomic_load_n(&_queued, __ATOMIC_RELAXED);
+}
+
+size_t Client::droppedBytes() const
+{
+    return __atomic_load_n(&_dropped, __ATOMIC_RELAXED);
+}
+
+bool Client::isSlowConsumer() const
+{
+    return __atomic_load_n(&_slow, __ATOMIC_RELAXED);
+}
+
+void Client::queueSend(const SharedBuffer &data, int priority)
+{
+    enqueue(data, priority, true);
+}
+
+void Client::queueFanout(const SharedBuffer &data, int priority)
+{
+    enqueue(data, priority, false);
+}
+
+void Client::enqueue(const SharedBuffer &data, int priority, bool inlineOk)
+{
+    if (data.empty())
+        return;
+    // _closing belongs to the owning loop; other loops post without
+    // looking at it and the owner drops the data on drain.
+    if (_loop && _loop != EventLoop::current())
+    {
+        _loop->post(this, data, priority);
+        return;
+    }
+    if (_closing)
+        return;
+    if (_class)
+    {
+        size_t after = _queued + data.size();
+        if (after > _class->sendqHard)
+        {
+            markClosing("SendQ exceeded");
+            return;
+        }
+        if (after > _class->sendqSoft)
+        {
+            if (!_slow)
+            {
+                __atomic_store_n(&_slow, true, __ATOMIC_RELAXED);
+                std::cout << "[Server] Slow consumer fd=" << _fd << " nick=" << _nickname
+                          << " sendq=" << _queued << " class=" << _class->name << std::endl;
+            }
+            if (priority == SEND_BULK)
+            {
+                __atomic_store_n(&_dropped, _dropped + data.size(), __ATOMIC_RELAXED);
+                if (_loop)
+                    Metrics::add(_loop->metrics().sendqDropped, data.size());
+                return;
+            }
+        }
+    }
+    // Only the first write of an iteration goes out inline; the dirty mark
+    // then batches whatever follows into the end-of-iteration writev.
+    size_t sent = 0;
+    if (inlineOk && _outbox.empty() && _loop && !_dirty)
+    {
+        sent = sendNow(data);
+        if (sent == data.size())
+        {
+            _loop->markDirty(*this);
+            return;
+        }
+    }
+    _outbox.push_back(data);
+    if (sent)
+        _outOffset = sent;
+    setQueued(_queued + data.size());
+    if (_loop)
+    {
+        _loop->metrics().sendqDepth.observe(_queued);
+        _loop->markDirty(*this);
+    }
+}
+
+// Fast path for an idle queue: the socket almost always has room, so the
+// bytes leave now instead of at the end of the loop iteration.
+size_t Client::sendNow(const SharedBuffer &data)
+{
+    ssize_t n;
+    do
+        n = ::send(_fd, data.data(), data.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return 0;
+    Metrics::add(_loop->metrics().bytesOut, n);
+    return static_cast<size_t>(n);
+}
+
 void Client::queueSend(const std::string &data)
 {
-    _outbox += data;
-    Server::instance()->enableWrite(_fd);
+    queueSend(SharedBuffer(data));
 }
 
 bool Client::hasPending() const
@@ -103,21 +339,187 @@ bool Client::hasPending() const
     return !_outbox.empty();
 }
 
+void Client::pendingOutput(std::string &out) const
+{
+    std::deque<SharedBuffer>::const_iterator it = _outbox.begin();
+    for (size_t skip = _outOffset; it != _outbox.end(); ++it, skip = 0)
+        out.append(it->data() + skip, it->size() - skip);
+}
+
 void Client::flushSend()
 {
     while (!_outbox.empty())
     {
-        ssize_t n = ::send(_fd, _outbox.data(), _outbox.size(), 0);
-        if (n > 0)
-            _outbox.erase(0, static_cast<size_t>(n));
-        else
+        struct iovec iov[FLUSH_IOV];
+        int cnt = 0;
+        size_t wanted = 0;
+        std::deque<SharedBuffer>::const_iterator it = _outbox.begin();
+        for (; it != _outbox.end() && cnt < FLUSH_IOV; ++it, ++cnt)
         {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                break;
+            size_t skip = cnt == 0 ? _outOffset : 0;
+            iov[cnt].iov_base = const_cast<char*>(it->data() + skip);
+            iov[cnt].iov_len = it->size() - skip;
+            wanted += iov[cnt].iov_len;
+        }
+
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        ssize_t n = ::sendmsg(_fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
             break;
+        if (_loop)
+            Metrics::add(_loop->metrics().bytesOut, n);
+
+        size_t left = static_cast<size_t>(n);
+        while (left > 0)
+        {
+            size_t avail = _outbox.front().size() - _outOffset;
+            if (left < avail)
+            {
+                _outOffset += left;
+                break;
+            }
+            left -= avail;
+            setQueued(_queued - _outbox.front().size());
+            _outbox.pop_front();
+            _outOffset = 0;
         }
+        if (static_cast<size_t>(n) < wanted)
+            break;
     }
 
+    if (!_loop)
+        return;
     if (_outbox.empty())
-        Server::instance()->disableWrite(_fd);
+        _loop->disableWrite(_fd);
+    else
+        _loop->enableWrite(_fd);
+}
+
+bool Client::isDirty() const
+{
+    return _dirty;
+}
+
+void Client::setDirty(bool dirty)
+{
+    _dirty = dirty;
+}
+
+// ircd-style fake lag: the penalty clock never falls behind real time,
+// and a client may run at most flood_burst ahead of it.
+bool Client::floodBlocked(unsigned long now) const
+{
+    if (!_class || !_class->floodPenalty)
+        return false;
+    return _floodClock > now + _class->floodBurst;
+}
+
+void Client::chargeFlood(unsigned int cost, unsigned long now)
+{
+    if (!_class || !_class->floodPenalty)
+        return;
+    if (_floodClock < now)
+        _floodClock = now;
+    _floodClock += cost * _class->floodPenalty;
+}
+
+unsigned long Client::floodResumeAt() const
+{
+    return _class ? _floodClock - _class->floodBurst : 0;
+}
+
+unsigned long Client::floodClock() const
+{
+    return _floodClock;
+}
+
+void Client::setFloodClock(unsigned long clock)
+{
+    _floodClock = clock;
+}
+
+bool Client::isParked() const
+{
+    return _parked;
+}
+
+void Client::setParked(bool parked)
+{
+    _parked = parked;
+}
+
+void Client::touch(unsigned long now)
+{
+    _lastActive = now;
+}
+
+unsigned long Client::lastActive() const
+{
+    return _lastActive;
+}
+
+unsigned long Client::pingSentAt() const
+{
+    return _pingSentAt;
+}
+
+void Client::setPingSentAt(unsigned long when)
+{
+    _pingSentAt = when;
+}
+
+Timer &Client::pingTimer()
+{
+    return _pingTimer;
+}
+
+Timer &Client::registerTimer()
+{
+    return _registerTimer;
+}
+
+Timer &Client::floodTimer()
+{
+    return _floodTimer;
+}
+
+// The owning loop closes the connection once the current event is done,
+// so a client can be condemned in the middle of a channel broadcast.
+void Client::markClosing(const std::string &reason)
+{
+    if (_closing)
+        return;
+    _closing = true;
+    _closeReason = reason;
+    // A buffer that is partly on the wire has to finish, or the peer sees
+    // half a line glued to the ERROR.
+    size_t kept = 0;
+    if (_outOffset > 0)
+    {
+        _outbox.resize(1);
+        kept = _outbox.front().size();
+    }
+    else
+        _outbox.clear();
+    SharedBuffer err("ERROR :Closing Link: " + (_nickname.empty() ? std::string("*") : _nickname)
+                     + " (" + reason + ")\r\n");
+    _outbox.push_back(err);
+    setQueued(kept + err.size());
+    if (_loop)
+        _loop->scheduleClose(_fd);
+}
+
+bool Client::isClosing() const
+{
+    return _closing;
+}
+
+const std::string &Client::closeReason() const
+{
+    return _closeReason;
 }
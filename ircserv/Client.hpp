@@ -2,35 +2,98 @@
 #define CLIENT_HPP
 
 #include <string>
+#include <set>
+#include <deque>
+#include "CaseMap.hpp"
+#include "SharedBuffer.hpp"
+#include "InputBuffer.hpp"
+#include "Pool.hpp"
+#include "Config.hpp"
+#include "TimerWheel.hpp"
+
+class Channel;
+class EventLoop;
+
+typedef std::set<Channel*, std::less<Channel*>, PoolAllocator<Channel*> > ChannelSet;
 
 class Client
 {
     private:
         int _fd;
+        EventLoop *_loop;
+        unsigned long _id;
         std::string _nickname;
+        FoldedName _foldedNick;
         std::string _username;
-        std::string _buffer;
         bool _authenticated;
 
         bool _pass_ok;
         bool _registered;
+        bool _oper;
+
+        InputBuffer _input;
+        std::deque<SharedBuffer> _outbox;
+        size_t _outOffset;
+        bool _dirty;
+        unsigned long _fanoutStamp;
+
+        const ConnClass *_class;
+        size_t _queued;
+        size_t _dropped;
+        bool _slow;
+        bool _closing;
+        std::string _closeReason;
+
+        unsigned long _floodClock;
+        bool _parked;
 
-        std::string _outbox;
+        unsigned long _lastActive;
+        unsigned long _pingSentAt;
+        Timer _pingTimer;
+        Timer _registerTimer;
+        Timer _floodTimer;
+
+        ChannelSet _channels;
+        // Channels holding an invitation for this client.
+        ChannelSet _invites;
+
+        void setQueued(size_t bytes);
+        size_t sendNow(const SharedBuffer &data);
+        void enqueue(const SharedBuffer &data, int priority, bool inlineOk);
+        void invalidateChannelReplies();
 
     public:
-        Client(int fd);
+        // Bulk traffic (channel PRIVMSG/NOTICE) is the first to go once a
+        // client's queue passes its class's soft watermark.
+        enum SendPriority
+        {
+            SEND_NORMAL,
+            SEND_BULK
+        };
+
+        // Longest accepted nickname; NAMES replies are split against it.
+        enum { NICKLEN = 30 };
+
+        Client(int fd, EventLoop *loop = 0, unsigned long id = 0);
         ~Client();
 
+        static void *operator new(size_t size);
+        static void operator delete(void *p);
+        static Pool &pool();
+
         int getFd() const;
+        EventLoop *getLoop() const;
+        unsigned long getId() const;
         const std::string &getNickname() const;
+        const FoldedName &foldedName() const;
         const std::string &getUsername() const;
         void setNickname(const std::string &nick);
         void setUsername(const std::string &user);
         bool isAuthenticated() const;
         void authenticate();
 
-        void appendToBuffer(const std::string &data);
-        std::string extractLine();
+        InputBuffer &getInput();
+        InputBuffer::LineStatus extractLine(Slice &line);
 
         void setPassOk(bool v);
         bool hasPassOk() const;
@@ -38,9 +101,61 @@ class Client
         void markRegistered();
         bool isRegistered() const;
 
+        void setOper(bool v);
+        bool isOper() const;
+
+        void addChannel(Channel *ch);
+        void removeChannel(Channel *ch);
+        const ChannelSet& getChannels() const;
+
+        void addInvite(Channel *ch);
+        void removeInvite(Channel *ch);
+        const ChannelSet& getInvites() const;
+
+        bool claimFanout(unsigned long stamp);
+        static unsigned long nextFanoutStamp();
+
+        void setClass(const ConnClass *cls);
+        const ConnClass *getClass() const;
+        // Written by the owning loop only; safe to read from any loop
+        // (STATS q).
+        size_t sendQueueBytes() const;
+        size_t droppedBytes() const;
+        // Sticky: set the first time the queue passes the soft watermark.
+        bool isSlowConsumer() const;
+
+        void queueSend(const SharedBuffer &data, int priority = SEND_NORMAL);
         void queueSend(const std::string &data);
+        // One copy of a broadcast. Never written inline: fan-out runs under
+        // the state lock, so the copies wait for the end-of-iteration flush.
+        void queueFanout(const SharedBuffer &data, int priority = SEND_NORMAL);
         bool hasPending() const;
+        // Appends the queued output not yet written to the socket.
+        void pendingOutput(std::string &out) const;
         void flushSend();
+        // Set while the client waits in its loop's end-of-iteration flush.
+        bool isDirty() const;
+        void setDirty(bool dirty);
+
+        bool floodBlocked(unsigned long now) const;
+        void chargeFlood(unsigned int cost, unsigned long now);
+        unsigned long floodResumeAt() const;
+        unsigned long floodClock() const;
+        void setFloodClock(unsigned long clock);
+        bool isParked() const;
+        void setParked(bool parked);
+
+        void touch(unsigned long now);
+        unsigned long lastActive() const;
+        unsigned long pingSentAt() const;
+        void setPingSentAt(unsigned long when);
+        Timer &pingTimer();
+        Timer &registerTimer();
+        Timer &floodTimer();
+
+        void markClosing(const std::string &reason);
+        bool isClosing() const;
+        const std::string &closeReason() const;
 };
 
 #endif
@@ -0,0 +1,84 @@
+#ifndef CODEC_HPP
+#define CODEC_HPP
+
+#include <string>
+#include <cstring>
+#include <cstddef>
+
+// Binary encoding shared by Snapshot and Handoff: host order integers
+// and strings as a u32 length followed by the bytes.
+
+inline unsigned long fnv1a(const char *p, size_t n)
+{
+    unsigned long h = 14695981039346656037UL;
+    for (size_t i = 0; i < n; ++i)
+    {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+// Sizes the output when out is null, fills it otherwise. Never
+// allocates, so it is safe in a child forked from a threaded process.
+struct Encoder
+{
+    char *out;
+    size_t len;
+
+    explicit Encoder(char *o) : out(o), len(0) {}
+
+    void bytes(const void *p, size_t n)
+    {
+        if (out)
+            std::memcpy(out + len, p, n);
+        len += n;
+    }
+
+    void u8(unsigned char v) { bytes(&v, 1); }
+    void u32(unsigned int v) { bytes(&v, 4); }
+    void u64(unsigned long v) { bytes(&v, 8); }
+
+    void str(const std::string &s)
+    {
+        u32((unsigned int)s.size());
+        bytes(s.data(), s.size());
+    }
+};
+
+struct Decoder
+{
+    const char *p;
+    const char *end;
+    bool ok;
+
+    Decoder(const char *begin, const char *e) : p(begin), end(e), ok(true) {}
+
+    bool take(void *dst, size_t n)
+    {
+        if (!ok || (size_t)(end - p) < n)
+            return ok = false;
+        std::memcpy(dst, p, n);
+        p += n;
+        return true;
+    }
+
+    unsigned char u8() { unsigned char v = 0; take(&v, 1); return v; }
+    unsigned int u32() { unsigned int v = 0; take(&v, 4); return v; }
+    unsigned long u64() { unsigned long v = 0; take(&v, 8); return v; }
+
+    std::string str()
+    {
+        unsigned int n = u32();
+        if (!ok || (size_t)(end - p) < n)
+        {
+            ok = false;
+            return std::string();
+        }
+        std::string s(p, n);
+        p += n;
+        return s;
+    }
+};
+
+#endif
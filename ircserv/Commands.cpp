@@ -2,51 +2,178 @@
 #include "Server.hpp"
 #include "Channel.hpp"
 #include "Client.hpp"
-#include <sstream>
+#include "Metrics.hpp"
 #include <sys/socket.h>
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
 #include <cctype>
 #include <unistd.h>
 #include <iostream>
-#include <map>
+#include <sstream>
+#include <ctime>
 
 
-void Replies::sendRaw(int fd, const std::string &raw)
+void Replies::sendRaw(Client &client, const std::string &raw)
 {
-    Client* c = Server::instance()->getClientByFd(fd);
-    if (!c) return;
-    c->queueSend(raw);
+    client.queueSend(raw);
 }
 
-void Replies::notice(int fd, const std::string &msg)
+void Replies::notice(Client &client, const std::string &msg)
 {
-    sendRaw(fd, ":ircserv NOTICE * :" + msg + "\r\n");
+    sendRaw(client, ":ircserv NOTICE * :" + msg + "\r\n");
 }
 
-void Replies::numeric(int fd, const std::string &code, const std::string &msg)
+void Replies::numeric(Client &client, const std::string &code, const std::string &msg)
 {
-    sendRaw(fd, ":ircserv " + code + " " + msg + "\r\n");
+    sendRaw(client, ":ircserv " + code + " " + msg + "\r\n");
 }
 
+enum
+{
+    CMD_PRIVMSG, CMD_JOIN, CMD_PING, CMD_NOTICE, CMD_MODE, CMD_NICK,
+    CMD_USER, CMD_PASS, CMD_KICK, CMD_INVITE, CMD_TOPIC, CMD_CAP,
+    CMD_WHO, CMD_NAMES, CMD_QUIT, CMD_PONG, CMD_OPER, CMD_STATS
+};
 
-static std::string trim(const std::string &s)
+static CommandSpec s_commands[] =
 {
-    std::string::size_type a = 0, b = s.size();
+    // name       handler             params  reg    cost  shared
+    { "PRIVMSG",  &Commands::privmsg, 0,      true,  1,     true },
+    { "JOIN",     &Commands::join,    1,      true,  2,     true },
+    { "PING",     &Commands::ping,    0,      false, 1,     false },
+    { "NOTICE",   &Commands::notice,  0,      true,  1,     true },
+    { "MODE",     &Commands::mode,    1,      true,  1,     true },
+    { "NICK",     &Commands::nick,    0,      false, 2,     true },
+    { "USER",     &Commands::user,    1,      false, 1,     true },
+    { "PASS",     &Commands::pass,    1,      false, 1,     false },
+    { "KICK",     &Commands::kick,    2,      true,  1,     true },
+    { "INVITE",   &Commands::invite,  2,      true,  2,     true },
+    { "TOPIC",    &Commands::topic,   1,      true,  1,     true },
+    { "CAP",      &Commands::cap,     0,      false, 1,     false },
+    { "WHO",      &Commands::who,     0,      true,  3,     true },
+    { "NAMES",    &Commands::names,   0,      true,  2,     true },
+    { "QUIT",     &Commands::quit,    0,      false, 0,     true },
+    { "PONG",     &Commands::pong,    0,      false, 1,     false },
+    { "OPER",     &Commands::oper,    2,      true,  2,     false },
+    { "STATS",    &Commands::stats,   0,      true,  3,     true }
+};
+
+static bool sameCommand(const Slice &name, const char *upper)
+{
+    size_t i = 0;
+    for (; i < name.len; ++i)
+    {
+        if (std::toupper((unsigned char)name[i]) != upper[i])
+            return false;
+    }
+    return upper[i] == '\0';
+}
 
-    while (a < b && (s[a] == ' ' || s[a] == '\t'))
-        ++a;
+const CommandSpec *Commands::lookup(const Slice &name)
+{
+    if (name.len < 3 || name.len > 7)
+        return 0;
+
+    int idx = -1;
+    char c0 = (char)std::toupper((unsigned char)name[0]);
+    char c1 = (char)std::toupper((unsigned char)name[1]);
+    switch (name.len)
+    {
+        case 3:
+            idx = c0 == 'C' ? CMD_CAP : c0 == 'W' ? CMD_WHO : -1;
+            break;
+        case 4:
+            switch (c0)
+            {
+                case 'P': idx = c1 == 'I' ? CMD_PING : c1 == 'O' ? CMD_PONG : CMD_PASS; break;
+                case 'J': idx = CMD_JOIN; break;
+                case 'M': idx = CMD_MODE; break;
+                case 'N': idx = CMD_NICK; break;
+                case 'U': idx = CMD_USER; break;
+                case 'K': idx = CMD_KICK; break;
+                case 'Q': idx = CMD_QUIT; break;
+                case 'O': idx = CMD_OPER; break;
+            }
+            break;
+        case 5:
+            idx = c0 == 'T' ? CMD_TOPIC : c0 == 'N' ? CMD_NAMES : c0 == 'S' ? CMD_STATS : -1;
+            break;
+        case 6:
+            idx = c0 == 'N' ? CMD_NOTICE : c0 == 'I' ? CMD_INVITE : -1;
+            break;
+        case 7:
+            idx = c0 == 'P' ? CMD_PRIVMSG : -1;
+            break;
+    }
+    if (idx < 0 || !sameCommand(name, s_commands[idx].name))
+        return 0;
+    return &s_commands[idx];
+}
 
-    while (b > a && (s[b-1] == ' ' || s[b-1] == '\t'))
-        --b;
-    return s.substr(a, b-a);
+bool Commands::setFloodCost(const std::string &name, unsigned int cost)
+{
+    const CommandSpec *spec = lookup(Slice(name));
+    if (!spec)
+        return false;
+    s_commands[spec - s_commands].floodCost = cost;
+    return true;
+}
+
+size_t Commands::count()
+{
+    return sizeof(s_commands) / sizeof(s_commands[0]);
+}
+
+const CommandSpec &Commands::at(size_t i)
+{
+    return s_commands[i];
+}
+
+unsigned int Commands::dispatch(Server &server, Client &client, const IrcMessage &msg)
+{
+    const CommandSpec *spec = lookup(msg.command);
+    size_t slot = spec ? (size_t)(spec - s_commands) : count();
+    Metrics *m = Metrics::current();
+    if (m)
+        Metrics::add(m->lines[slot]);
+    if (!spec)
+    {
+        Replies::numeric(client, "421", msg.command.str() + " :Unknown command");
+        return 1;
+    }
+    if (spec->needsRegistration && !client.isAuthenticated())
+    {
+        Replies::numeric(client, "451", ":You have not registered");
+        return 1;
+    }
+    if (msg.paramCount < spec->minParams)
+    {
+        Replies::numeric(client, "461", std::string(spec->name) + " :Not enough parameters");
+        return 1;
+    }
+    unsigned long start = m ? Metrics::monotonicNs() : 0;
+    if (spec->shared)
+    {
+        StateGuard guard(server);
+        spec->handler(server, client, msg);
+    }
+    else
+        spec->handler(server, client, msg);
+    if (m)
+        m->latencyNs[slot].observe(Metrics::monotonicNs() - start);
+    return spec->floodCost;
 }
 
-static std::string trim_leading_colon(std::string s)
+// RPL_ISUPPORT, sent once after 001.
+static std::string isupport(const std::string &nick)
 {
-    if (!s.empty() && s[0] == ':')
-        s.erase(0,1);
-    return s;
+    std::ostringstream os;
+    os << nick << " CASEMAPPING=rfc1459 CHANTYPES=# PREFIX=(ov)@+ CHANMODES=,k,l,it"
+       << " NICKLEN=" << Client::NICKLEN
+       << " TARGMAX=PRIVMSG:" << Commands::MAX_TARGETS << ",NOTICE:" << Commands::MAX_TARGETS
+       << " :are supported by this server";
+    return os.str();
 }
 
 void Commands::tryRegister(Server &server, Client &client)
@@ -61,196 +188,224 @@ void Commands::tryRegister(Server &server, Client &client)
 
     client.markRegistered();
     client.authenticate();
-    Replies::numeric(client.getFd(), "001",
+    Replies::numeric(client, "001",
         (client.getNickname().empty() ? "Welcome" : client.getNickname() + " :Welcome"));
+    Replies::numeric(client, "005", isupport(client.getNickname()));
 }
 
-void Commands::pass(Server &server, Client &client, const std::string &args)
+void Commands::pass(Server &server, Client &client, const IrcMessage &msg)
 {
-    if (args == server.getPassword())
+    if (msg.arg(0) == server.getPassword())
     {
         client.setPassOk(true);
         tryRegister(server, client);
     }
     else
     {
-        Replies::numeric(client.getFd(), "464", ":Password incorrect");
+        Replies::numeric(client, "464", ":Password incorrect");
     }
 }
 
-void Commands::nick(Server &server, Client &client, const std::string &args)
+void Commands::nick(Server &server, Client &client, const IrcMessage &msg)
 {
-    std::string nick = trim(args);
+    std::string nick = msg.arg(0);
     if (nick.empty())
     {
-        Replies::numeric(client.getFd(),"431",":No nickname given");
+        Replies::numeric(client, "431",":No nickname given");
+        return;
+    }
+    if (nick.size() > Client::NICKLEN)
+    {
+        Replies::numeric(client, "432", nick + " :Erroneous nickname");
+        return;
+    }
+
+    if (!server.renameClient(client, nick))
+    {
+        Replies::numeric(client, "433", nick + " :Nickname is already in use");
         return;
     }
-    
-    client.setNickname(nick);
     tryRegister(server, client);
 }
 
-void Commands::user(Server &server, Client &client, const std::string &args)
+void Commands::user(Server &server, Client &client, const IrcMessage &msg)
 {
-    std::istringstream iss(args);
-    std::string username;
-    iss >> username;
-    
+    std::string username = msg.arg(0);
+
     if (username.empty())
     {
-        Replies::numeric(client.getFd(),"461","USER :Not enough parameters");
+        Replies::numeric(client, "461","USER :Not enough parameters");
         return;
     }
     client.setUsername(username);
     tryRegister(server, client);
 }
 
-void Commands::join(Server &server, Client &client, const std::string &args)
+void Commands::join(Server &server, Client &client, const IrcMessage &msg)
 {
-    if (!client.isAuthenticated())
-    {
-        Replies::numeric(client.getFd(),"451",":You have not registered");
-        return;
-    }
-    
-    std::istringstream iss(args);
-    std::string channelName, key;
-    iss >> channelName >> key;
+    std::string channelName = msg.arg(0);
+    std::string key = msg.arg(1);
 
     if (channelName.empty() || channelName[0] != '#')
     {
-        Replies::numeric(client.getFd(),"403",":No such channel");
+        Replies::numeric(client, "403",":No such channel");
         return;
     }
 
     Channel *ch = server.getChannel(channelName);
 
-    if (ch->isInviteOnly() && !ch->isInvited(&client) && !ch->isOperator(&client))
+    if (ch->isInviteOnly() && !ch->isInvited(&client) && !ch->isOperator(&client)
+        && !ch->isSavedOperator(&client))
     {
-        Replies::numeric(client.getFd(), "473", channelName + " :Invite-only channel");
+        Replies::numeric(client, "473", channelName + " :Invite-only channel");
         return;
     }
 
-    if (ch->getLimit() != 0 && ch->getClients().size() >= ch->getLimit())
+    if (ch->getLimit() != 0 && ch->memberCount() >= ch->getLimit())
     {
-        Replies::numeric(client.getFd(), "471", channelName + " :Channel is full");
+        Replies::numeric(client, "471", channelName + " :Channel is full");
         return;
     }
 
     if (!ch->getKey().empty() && key != ch->getKey())
     {
-        Replies::numeric(client.getFd(),"475", channelName + " :Cannot join channel (+k)");
+        Replies::numeric(client, "475", channelName + " :Cannot join channel (+k)");
         return;
     }
 
     ch->addClient(&client);
 
-    std::string joinMsg = ":" + (client.getNickname().empty() ? "anon" : client.getNickname()) + " JOIN " + ch->getName() + "\r\n";
-    const std::set<Client*>& clients = ch->getClients();
-    std::set<Client*>::const_iterator it = clients.begin();
-    
-    for (; it != clients.end(); ++it)
-        Replies::sendRaw((*it)->getFd(), joinMsg);
+    ch->broadcast(SharedBuffer(":" + (client.getNickname().empty() ? "anon" : client.getNickname()) + " JOIN " + ch->getName() + "\r\n"));
 
     if (!ch->getTopic().empty())
-        Replies::numeric(client.getFd(), "332", ch->getName() + " :" + ch->getTopic());
-    Commands::names(server, client, ch->getName());
+        Replies::numeric(client, "332", ch->getName() + " :" + ch->getTopic());
+    sendNames(client, ch, ch->getName());
 }
 
-void Commands::privmsg(Server &server, Client &client, const std::string &args)
+// Shared by PRIVMSG and NOTICE. Targets are a comma separated list of
+// channels and nicks, each line encoded once per target; a fan-out stamp
+// gives a client reached through several targets a single copy. NOTICE
+// never answers with errors.
+static void deliverMessage(Server &server, Client &client, const IrcMessage &msg,
+                           const char *verb, bool replies)
 {
-    if (!client.isAuthenticated())
+    const Slice &targets = msg.param(0);
+    if (targets.empty())
     {
-        Replies::numeric(client.getFd(),"451",":You have not registered");
+        if (replies)
+            Replies::numeric(client, "411", std::string(":No recipient given (") + verb + ")");
         return;
     }
-
-    std::istringstream iss(args);
-    std::string target; iss >> target;
-    std::string message; std::getline(iss, message);
-    
-    if (!message.empty() && message[0] == ' ')
-        message.erase(0,1);
-
-    Channel *ch = 0;
-    if (!target.empty() && target[0] == '#') {
-        std::map<std::string, Channel*>& chans = server.getChannels();
-        std::map<std::string, Channel*>::iterator itc = chans.find(target);
-        if (itc != chans.end()) ch = itc->second;
-    }
-    
-    if (ch && ch->hasClient(&client))
+    if (msg.param(1).empty())
     {
-        ch->broadcast(&client, message);
+        if (replies)
+            Replies::numeric(client, "412",":No text to send");
+        return;
     }
-    else
+
+    Slice from = client.getNickname().empty() ? Slice("anon") : Slice(client.getNickname());
+    unsigned long stamp = Client::nextFanoutStamp();
+    size_t sent = 0;
+    const char *p = targets.data;
+    const char *end = targets.data + targets.len;
+    while (p < end)
     {
-        Replies::numeric(client.getFd(),"401", target + " :No such nick/channel");
+        const char *comma = static_cast<const char*>(std::memchr(p, ',', end - p));
+        if (!comma)
+            comma = end;
+        Slice target(p, comma - p);
+        p = comma + 1;
+        if (target.empty())
+            continue;
+
+        if (++sent > Commands::MAX_TARGETS)
+        {
+            if (replies)
+                Replies::numeric(client, "407", target.str() + " :Too many recipients");
+            continue;
+        }
+
+        if (target[0] == '#')
+        {
+            Channel *ch = server.findChannel(target);
+            if (ch && ch->hasClient(&client))
+            {
+                Slice parts[] = { ":", from, " ", verb, " ", ch->getName(),
+                                  " :", msg.param(1), "\r\n" };
+                ch->broadcastOnce(SharedBuffer::concat(parts, sizeof(parts) / sizeof(parts[0])),
+                                  stamp, &client, Client::SEND_BULK);
+                continue;
+            }
+        }
+        else if (Client *rcv = server.getClientByNickname(target))
+        {
+            if (rcv->claimFanout(stamp))
+            {
+                Slice parts[] = { ":", from, " ", verb, " ", rcv->getNickname(),
+                                  " :", msg.param(1), "\r\n" };
+                rcv->queueSend(SharedBuffer::concat(parts, sizeof(parts) / sizeof(parts[0])));
+            }
+            continue;
+        }
+        if (replies)
+            Replies::numeric(client, "401", target.str() + " :No such nick/channel");
     }
 }
 
-void Commands::kick(Server &server, Client &client, const std::string &args)
+void Commands::privmsg(Server &server, Client &client, const IrcMessage &msg)
 {
-    std::istringstream iss(args);
-    std::string channelName, targetNick; iss >> channelName >> targetNick;
+    deliverMessage(server, client, msg, "PRIVMSG", true);
+}
+
+void Commands::kick(Server &server, Client &client, const IrcMessage &msg)
+{
+    std::string channelName = msg.arg(0);
+    std::string targetNick = msg.arg(1);
 
     if (channelName.empty() || targetNick.empty())
     {
-        Replies::numeric(client.getFd(), "461", "KICK :Not enough parameters");
+        Replies::numeric(client, "461", "KICK :Not enough parameters");
         return;
     }
 
-    Channel *ch = 0;
-    {
-        std::map<std::string, Channel*>& chans = server.getChannels();
-        std::map<std::string, Channel*>::iterator itc = chans.find(channelName);
-        if (itc != chans.end()) ch = itc->second;
-    }
+    Channel *ch = server.findChannel(channelName);
 
     if (!ch)
     {
-        Replies::numeric(client.getFd(),"403", channelName + " :No such channel");
+        Replies::numeric(client, "403", channelName + " :No such channel");
         return;
     }
 
     if (!ch->hasClient(&client) || !ch->isOperator(&client))
     {
-        Replies::numeric(client.getFd(),"482", channelName + " :You're not channel operator");
+        Replies::numeric(client, "482", channelName + " :You're not channel operator");
         return;
     }
 
     Client *target = server.getClientByNickname(targetNick);
     if (!target || !ch->hasClient(target))
     {
-        Replies::numeric(client.getFd(),"441", targetNick + " " + channelName + " :They aren't on that channel");
+        Replies::numeric(client, "441", targetNick + " " + channelName + " :They aren't on that channel");
         return;
     }
 
     ch->removeClient(target);
-    std::string raw = ":" + client.getNickname() + " KICK " + ch->getName() + " " + targetNick + "\r\n";
-    const std::set<Client*>& clients = ch->getClients();
-    for (std::set<Client*>::const_iterator it = clients.begin(); it != clients.end(); ++it)
-        Replies::sendRaw((*it)->getFd(), raw);
-    Replies::sendRaw(target->getFd(), raw);
+    SharedBuffer raw(":" + client.getNickname() + " KICK " + ch->getName() + " " + targetNick + "\r\n");
+    ch->broadcast(raw);
+    target->queueSend(raw);
 }
 
 
-void Commands::invite(Server &server, Client &client, const std::string &args)
+void Commands::invite(Server &server, Client &client, const IrcMessage &msg)
 {
-    std::istringstream iss(args);
-    std::string channelName, targetNick; iss >> channelName >> targetNick;
+    std::string channelName = msg.arg(0);
+    std::string targetNick = msg.arg(1);
 
-    Channel *ch = 0;
-    {
-        std::map<std::string, Channel*>& chans = server.getChannels();
-        std::map<std::string, Channel*>::iterator itc = chans.find(channelName);
-        if (itc != chans.end()) ch = itc->second;
-    }
+    Channel *ch = server.findChannel(channelName);
     
     if (!ch || !ch->isOperator(&client))
     {
-        Replies::numeric(client.getFd(),"482",channelName + " :You're not channel operator");
+        Replies::numeric(client, "482",channelName + " :You're not channel operator");
         return;
     }
 
@@ -258,88 +413,68 @@ void Commands::invite(Server &server, Client &client, const std::string &args)
     
     if (!target)
     {
-        Replies::numeric(client.getFd(),"401", targetNick + " :No such nick");
+        Replies::numeric(client, "401", targetNick + " :No such nick");
         return;
     }
 
     ch->invite(target);
     std::string raw = ":" + client.getNickname() + " INVITE " + targetNick + " " + ch->getName() + "\r\n";
-    Replies::sendRaw(target->getFd(), raw);
+    Replies::sendRaw(*target, raw);
 }
 
-void Commands::topic(Server &server, Client &client, const std::string &args)
+void Commands::topic(Server &server, Client &client, const IrcMessage &msg)
 {
-    std::istringstream iss(args);
-    std::string channelName; iss >> channelName;
-    std::string topic; std::getline(iss, topic);
-    
-    if (!topic.empty() && topic[0]==' ')
-        topic.erase(0,1);
+    std::string channelName = msg.arg(0);
+    std::string topic = msg.arg(1);
+    bool setting = msg.paramCount > 1;
 
-    Channel *ch = 0;
-    {
-        std::map<std::string, Channel*>& chans = server.getChannels();
-        std::map<std::string, Channel*>::iterator itc = chans.find(channelName);
-        if (itc != chans.end()) ch = itc->second;
-    }
+    Channel *ch = server.findChannel(channelName);
     
     if (!ch)
     {
-        Replies::numeric(client.getFd(),"403",":No such channel");
+        Replies::numeric(client, "403",":No such channel");
         return;
     }
     
-    if (ch->isTopicRestricted() && !ch->isOperator(&client) && !topic.empty())
+    if (ch->isTopicRestricted() && !ch->isOperator(&client) && setting)
     {
-        Replies::numeric(client.getFd(),"482", channelName + " :You're not channel operator");
+        Replies::numeric(client, "482", channelName + " :You're not channel operator");
         return;
     }
 
-    if (topic.empty())
+    if (!setting)
     {
         if (ch->getTopic().empty())
-            Replies::numeric(client.getFd(), "331", channelName + " :No topic is set");
+            Replies::numeric(client, "331", channelName + " :No topic is set");
         else
-            Replies::numeric(client.getFd(), "332", channelName + " :" + ch->getTopic());
+            Replies::numeric(client, "332", channelName + " :" + ch->getTopic());
         return;
     }
     else
     {
         ch->setTopic(topic);
-        std::string raw = ":" + client.getNickname() + " TOPIC " + ch->getName() + " :" + ch->getTopic() + "\r\n";
-        const std::set<Client*>& clients = ch->getClients();
-        std::set<Client*>::const_iterator it = clients.begin();
-        
-        for (; it != clients.end(); ++it)
-            Replies::sendRaw((*it)->getFd(), raw);
+        ch->broadcast(SharedBuffer(":" + client.getNickname() + " TOPIC " + ch->getName() + " :" + ch->getTopic() + "\r\n"));
     }
 }
 
-void Commands::mode(Server &server, Client &client, const std::string &args)
+void Commands::mode(Server &server, Client &client, const IrcMessage &msg)
 {
-    (void)server;
-    std::istringstream iss(args);
-    std::string channelName; iss >> channelName;
+    std::string channelName = msg.arg(0);
 
-    Channel *ch = 0;
-    {
-        std::map<std::string, Channel*>& chans = server.getChannels();
-        std::map<std::string, Channel*>::iterator itc = chans.find(channelName);
-        if (itc != chans.end()) ch = itc->second;
-    }
+    Channel *ch = server.findChannel(channelName);
     
     if (!ch)
     {
-        Replies::numeric(client.getFd(),"403",":No such channel");
+        Replies::numeric(client, "403",":No such channel");
         return;
     }
     
-    std::string modes; iss >> modes;
-    std::string param; iss >> param;
+    std::string modes = msg.arg(1);
+    std::string param = msg.arg(2);
 
     if (!ch->isOperator(&client))
     {
-        Replies::numeric(client.getFd(),"482",channelName + " :You're not channel operator");
+        Replies::numeric(client, "482",channelName + " :You're not channel operator");
         return;
     }
 
@@ -396,6 +531,19 @@ void Commands::mode(Server &server, Client &client, const std::string &args)
                     ch->removeOperator(t);
             }
         }
+        else if (c=='v')
+        {
+            Client *t = 0;
+            if (!param.empty())
+                t = server.getClientByNickname(param);
+            if (t)
+            {
+                if (sign>0)
+                    ch->addVoice(t);
+                else
+                    ch->removeVoice(t);
+            }
+        }
     }
 
     std::string reply = ":" + client.getNickname() + " MODE " + ch->getName() + " " + modes;
@@ -403,132 +551,75 @@ void Commands::mode(Server &server, Client &client, const std::string &args)
     if (!param.empty())
         reply += " " + param;
     reply += "\r\n";
-    
-    const std::set<Client*>& clients = ch->getClients();
-    std::set<Client*>::const_iterator it = clients.begin();
-    
-    for (; it != clients.end(); ++it)
-        Replies::sendRaw((*it)->getFd(), reply);
+    ch->broadcast(SharedBuffer(reply));
 }
 
-void Commands::ping(Server &, Client &client, const std::string &args)
+void Commands::ping(Server &, Client &client, const IrcMessage &msg)
 {
-    std::string token = trim_leading_colon(trim(args));
-    
+    std::string token = msg.arg(0);
+
     if (token.empty())
         token = "ping";
-    Replies::sendRaw(client.getFd(), ":ircserv PONG ircserv :" + token + "\r\n");
+    Replies::sendRaw(client, ":ircserv PONG ircserv :" + token + "\r\n");
 }
 
-void Commands::cap(Server &, Client &client, const std::string &args)
+// Any input counts as activity for the keepalive timer, so a PONG has
+// nothing left to do once it has been read.
+void Commands::pong(Server &, Client &, const IrcMessage &)
 {
-    std::istringstream iss(args);
-    std::string sub; iss >> sub;
-    
+}
+
+void Commands::cap(Server &, Client &client, const IrcMessage &msg)
+{
+    std::string sub = msg.arg(0);
+
     for (size_t i=0;i<sub.size();++i)
         sub[i] = (char)std::toupper((unsigned char)sub[i]);
 
     if (sub == "LS") 
-        Replies::sendRaw(client.getFd(), ":ircserv CAP * LS :\r\n");
+        Replies::sendRaw(client, ":ircserv CAP * LS :\r\n");
     else if (sub == "LIST")
-        Replies::sendRaw(client.getFd(), ":ircserv CAP * LIST :\r\n");
+        Replies::sendRaw(client, ":ircserv CAP * LIST :\r\n");
     else if (sub == "REQ")
     {
-        std::string rest; std::getline(iss, rest);
-        
-        if (!rest.empty() && rest[0]==' ')
-            rest.erase(0,1);
-        Replies::sendRaw(client.getFd(), ":ircserv CAP * NAK :" + rest + "\r\n");
+        Replies::sendRaw(client, ":ircserv CAP * NAK :" + msg.arg(1) + "\r\n");
     }
     else if (sub == "END"){}
     else
-        Replies::sendRaw(client.getFd(), ":ircserv CAP * NAK :\r\n");
+        Replies::sendRaw(client, ":ircserv CAP * NAK :\r\n");
 }
 
-void Commands::notice(Server &server, Client &client, const std::string &args)
+void Commands::notice(Server &server, Client &client, const IrcMessage &msg)
 {
-    std::istringstream iss(args);
-    std::string target; iss >> target;
-
-    std::string message; std::getline(iss, message);
-    if (!message.empty() && message[0] == ' ')
-        message.erase(0, 1);
-    if (!message.empty() && message[0] == ':')
-        message.erase(0, 1);
-
-    if (target.empty() || message.empty())
-        return;
-
-    if (!target.empty() && target[0] == '#')
-    {
-        Channel *ch = 0;
-        {
-            std::map<std::string, Channel*>& chans = server.getChannels();
-            std::map<std::string, Channel*>::iterator itc = chans.find(target);
-            if (itc != chans.end()) ch = itc->second;
-        }
-        if (!ch || !ch->hasClient(&client))
-            return;
-
-        const std::set<Client*>& clients = ch->getClients();
-        for (std::set<Client*>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
-            Client *rcv = *it;
-            if (rcv == &client) continue;
-            std::string raw = ":" + (client.getNickname().empty() ? "anon" : client.getNickname())
-                            + " NOTICE " + ch->getName() + " :" + message + "\r\n";
-            Replies::sendRaw(rcv->getFd(), raw);
-        }
-        return;
-    }
-
-    Client *rcv = server.getClientByNickname(target);
-    if (!rcv)
-        return;
-    
-    std::string raw = ":" + (client.getNickname().empty() ? "anon" : client.getNickname())
-                    + " NOTICE " + target + " :" + message + "\r\n";
-    Replies::sendRaw(rcv->getFd(), raw);
+    deliverMessage(server, client, msg, "NOTICE", false);
 }
 
-void Commands::who(Server &server, Client &client, const std::string &args)
+void Commands::who(Server &server, Client &client, const IrcMessage &msg)
 {
-    std::istringstream iss(args);
-    std::string mask; iss >> mask;
+    std::string mask = msg.arg(0);
 
     const std::string me = client.getNickname().empty() ? "*" : client.getNickname();
-    const int fd = client.getFd();
 
     std::string endMask = mask.empty() ? "*" : mask;
     std::string endLine = ":ircserv 315 " + me + " " + endMask + " :End of /WHO list\r\n";
 
     if (!mask.empty() && mask[0] == '#')
     {
-        Channel *ch = 0;
-        {
-            std::map<std::string, Channel*>& chans = server.getChannels();
-            std::map<std::string, Channel*>::iterator itc = chans.find(mask);
-            if (itc != chans.end()) ch = itc->second;
-        }
+        Channel *ch = server.findChannel(mask);
+        std::string out;
         if (ch)
         {
-            const std::set<Client*>& clients = ch->getClients();
-            
-            for (std::set<Client*>::const_iterator it = clients.begin(); it != clients.end(); ++it)
+            const std::vector<std::string> &lines = ch->whoLines();
+            std::string head = ":ircserv 352 " + me + " ";
+            out.reserve(lines.size() * (head.size() + 64) + endLine.size());
+            for (size_t i = 0; i < lines.size(); ++i)
             {
-                Client *c = *it;
-                std::string nick = c->getNickname().empty() ? "anon" : c->getNickname();
-                std::string user = c->getUsername().empty() ? "user" : c->getUsername();
-                std::string flags = "H";
-                if (ch->isOperator(c))
-                    flags += "@";
-
-                std::string line = ":ircserv 352 " + me + " " + mask + " " + user
-                                 + " localhost ircserv " + nick + " " + flags
-                                 + " :0 " + nick + "\r\n";
-                Replies::sendRaw(fd, line);
+                out += head;
+                out += lines[i];
             }
         }
-        Replies::sendRaw(fd, endLine);
+        out += endLine;
+        Replies::sendRaw(client, out);
         return;
     }
 
@@ -542,95 +633,220 @@ void Commands::who(Server &server, Client &client, const std::string &args)
             std::string line = ":ircserv 352 " + me + " * " + user
                              + " localhost ircserv " + nick + " H"
                              + " :0 " + nick + "\r\n";
-            Replies::sendRaw(fd, line);
+            Replies::sendRaw(client, line);
         }
     }
-    Replies::sendRaw(fd, endLine);
+    Replies::sendRaw(client, endLine);
 }
 
-void Commands::names(Server &server, Client &client, const std::string &args)
+void Commands::sendNames(Client &client, Channel *ch, const std::string &chan)
 {
-    std::istringstream iss(args);
-    std::string channels; iss >> channels;
-
     const std::string me = client.getNickname().empty() ? "*" : client.getNickname();
-    const int fd = client.getFd();
-
-    const std::string send_end_all = ":ircserv 366 " + me + " * :End of /NAMES list\r\n";
-    const std::string send_end = " :End of /NAMES list\r\n";
 
-    if (!channels.empty())
+    std::string out;
+    if (ch)
     {
-        std::string rest = channels;
-        while (!rest.empty())
+        const std::vector<std::string> &blocks = ch->namesBlocks();
+        std::string head = ":ircserv 353 " + me + " = " + chan + " :";
+        out.reserve(blocks.size() * 512);
+        for (size_t i = 0; i < blocks.size(); ++i)
         {
-            std::string chan;
-            std::string::size_type pos = rest.find(',');
-            if (pos == std::string::npos)
-            {
-                chan = rest;
-                rest.clear();
-            }
-            else
-            {
-                chan = rest.substr(0, pos);
-                rest.erase(0, pos + 1);
-            }
-
-            if (!chan.empty() && chan[0] == '#') {
-                Channel *ch = 0;
-                {
-                    std::map<std::string, Channel*>& chans = server.getChannels();
-                    std::map<std::string, Channel*>::iterator itc = chans.find(chan);
-                    if (itc != chans.end()) ch = itc->second;
-                }
-                if (ch) {
-                    std::string nicks;
-                    const std::set<Client*>& clients = ch->getClients();
-                    for (std::set<Client*>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
-                        Client *c = *it;
-                        std::string nick = c->getNickname().empty() ? "anon" : c->getNickname();
-                        if (!nicks.empty()) nicks += " ";
-                        if (ch->isOperator(c)) nicks += "@";
-                        nicks += nick;
-                    }
-                    Replies::sendRaw(fd, ":ircserv 353 " + me + " = " + chan + " :" + nicks + "\r\n");
-                }
-                Replies::sendRaw(fd, ":ircserv 366 " + me + " " + chan + send_end);
-            }
+            out += head;
+            out += blocks[i];
+            out += "\r\n";
         }
+    }
+    out += ":ircserv 366 " + me + " " + chan + " :End of /NAMES list\r\n";
+    Replies::sendRaw(client, out);
+}
+
+void Commands::names(Server &server, Client &client, const IrcMessage &msg)
+{
+    std::string channels = msg.arg(0);
+
+    if (channels.empty())
+    {
+        const std::string me = client.getNickname().empty() ? "*" : client.getNickname();
+        Replies::sendRaw(client, ":ircserv 366 " + me + " * :End of /NAMES list\r\n");
         return;
     }
-    Replies::sendRaw(fd, send_end_all);
+
+    std::string rest = channels;
+    while (!rest.empty())
+    {
+        std::string chan;
+        std::string::size_type pos = rest.find(',');
+        if (pos == std::string::npos)
+        {
+            chan = rest;
+            rest.clear();
+        }
+        else
+        {
+            chan = rest.substr(0, pos);
+            rest.erase(0, pos + 1);
+        }
+
+        if (!chan.empty() && chan[0] == '#')
+            sendNames(client, server.findChannel(chan), chan);
+    }
 }
 
-void Commands::quit(Server &server, Client &client, const std::string &args)
+void Commands::quit(Server &server, Client &client, const IrcMessage &msg)
 {
-    std::string message = args;
-    if (!message.empty() && message[0] == ':')
-        message.erase(0, 1);
+    std::string message = msg.arg(0);
 
-    std::string quitMsg = ":" + (client.getNickname().empty() ? "anon" : client.getNickname())
-                        + " QUIT :" + (message.empty() ? "Client Quit" : message) + "\r\n";
+    SharedBuffer quitMsg(":" + (client.getNickname().empty() ? "anon" : client.getNickname())
+                         + " QUIT :" + (message.empty() ? "Client Quit" : message) + "\r\n");
 
-    std::map<std::string, Channel*> channels = server.getChannels();
-    for (std::map<std::string, Channel*>::iterator it = channels.begin(); it != channels.end(); ++it)
+    unsigned long stamp = Client::nextFanoutStamp();
+    client.claimFanout(stamp);
+    const ChannelSet& joined = client.getChannels();
+    for (ChannelSet::const_iterator it = joined.begin(); it != joined.end(); ++it)
     {
-        Channel *ch = it->second;
-        if (ch->hasClient(&client))
+        const Membership *m = (*it)->members();
+        for (size_t i = 0, n = (*it)->memberCount(); i < n; ++i)
         {
-            const std::set<Client*>& clients = ch->getClients();
-            for (std::set<Client*>::const_iterator cit = clients.begin(); cit != clients.end(); ++cit)
-            {
-                Client *c = *cit;
-                if (c != &client)
-                    Replies::sendRaw(c->getFd(), quitMsg);
-            }
-            ch->removeClient(&client);
+            if (m[i].client->claimFanout(stamp))
+                m[i].client->queueFanout(quitMsg);
         }
     }
 
     int fd = client.getFd();
-    server.removeClient(fd);
+    server.removeClient(client);
     std::cout << "[Server] Client quit fd=" << fd << std::endl;
 }
+
+void Commands::oper(Server &server, Client &client, const IrcMessage &msg)
+{
+    const OperBlock *op = server.getConfig().findOper(msg.arg(0));
+    if (!op || op->password != msg.arg(1))
+    {
+        Replies::numeric(client, "464", ":Password incorrect");
+        return;
+    }
+    client.setOper(true);
+    Replies::numeric(client, "381", client.getNickname() + " :You are now an IRC operator");
+    std::cout << "[Server] " << client.getNickname() << " is now an operator" << std::endl;
+}
+
+typedef std::pair<size_t, Client*> QueueDepth;
+
+static bool deeperQueue(const QueueDepth &a, const QueueDepth &b)
+{
+    return a.first > b.first;
+}
+
+// STATS m: lines per command, STATS t: handler latency per command,
+// STATS z: connection, traffic, fan-out and pool totals, STATS u: uptime,
+// STATS q: clients with queued output or a slow-consumer record, deepest
+// queue first.
+void Commands::stats(Server &server, Client &client, const IrcMessage &msg)
+{
+    std::string letter = msg.arg(0).empty() ? "*" : msg.arg(0).substr(0, 1);
+    const std::string &nick = client.getNickname();
+    if (!client.isOper())
+    {
+        Replies::numeric(client, "481", nick + " :Permission Denied- You're not an IRC operator");
+        return;
+    }
+
+    Metrics total;
+    server.collectMetrics(total);
+    size_t n = count() + 1;
+
+    if (letter == "m")
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (!total.lines[i])
+                continue;
+            std::ostringstream os;
+            os << nick << " " << (i < count() ? s_commands[i].name : "UNKNOWN") << " "
+               << total.lines[i] << " 0 0";
+            Replies::numeric(client, "212", os.str());
+        }
+    }
+    else if (letter == "t")
+    {
+        for (size_t i = 0; i < count(); ++i)
+        {
+            const Histogram &h = total.latencyNs[i];
+            if (!h.count)
+                continue;
+            std::ostringstream os;
+            os << nick << " :" << s_commands[i].name << " calls=" << h.count
+               << " avg_ns=" << h.sum / h.count << " p50_ns<=" << h.quantile(0.5)
+               << " p99_ns<=" << h.quantile(0.99);
+            Replies::numeric(client, "249", os.str());
+        }
+    }
+    else if (letter == "z")
+    {
+        std::ostringstream os;
+        os << nick << " :connections=" << total.connectionsAccepted - total.connectionsClosed
+           << " accepted=" << total.connectionsAccepted
+           << " bytes_in=" << total.bytesIn << " bytes_out=" << total.bytesOut;
+        Replies::numeric(client, "249", os.str());
+        os.str("");
+        os << nick << " :sendq_bytes=" << total.sendqBytes << " sendq_dropped=" << total.sendqDropped
+           << " sendq_p99<=" << total.sendqDepth.quantile(0.99)
+           << " fanout_p50<=" << total.fanout.quantile(0.5)
+           << " fanout_p99<=" << total.fanout.quantile(0.99);
+        Replies::numeric(client, "249", os.str());
+
+        std::vector<PoolStats> pools;
+        Pool::collect(pools);
+        for (size_t i = 0; i < pools.size(); ++i)
+        {
+            os.str("");
+            os << nick << " :pool " << pools[i].name << "/" << pools[i].objectSize
+               << " live=" << pools[i].live << " free=" << pools[i].free
+               << " slabs=" << pools[i].slabs;
+            Replies::numeric(client, "249", os.str());
+        }
+    }
+    else if (letter == "q")
+    {
+        // Other loops keep changing the depths, so they are read once and
+        // the copies are sorted.
+        std::vector<Client*> all;
+        for (size_t i = 0; i < server.loops().size(); ++i)
+            server.loops()[i]->collectClients(all);
+        std::vector<QueueDepth> queued;
+        for (size_t i = 0; i < all.size(); ++i)
+        {
+            size_t bytes = all[i]->sendQueueBytes();
+            if (bytes || all[i]->isSlowConsumer())
+                queued.push_back(QueueDepth(bytes, all[i]));
+        }
+        std::sort(queued.begin(), queued.end(), deeperQueue);
+        size_t shown = std::min(queued.size(), (size_t)STATS_Q_MAX);
+        for (size_t i = 0; i < shown; ++i)
+        {
+            const Client *c = queued[i].second;
+            std::ostringstream os;
+            os << nick << " :fd=" << c->getFd() << " nick="
+               << (c->getNickname().empty() ? "*" : c->getNickname())
+               << " class=" << (c->getClass() ? c->getClass()->name : "-")
+               << " sendq=" << queued[i].first << " dropped=" << c->droppedBytes()
+               << " slow=" << (c->isSlowConsumer() ? 1 : 0);
+            Replies::numeric(client, "249", os.str());
+        }
+        if (shown < queued.size())
+        {
+            std::ostringstream os;
+            os << nick << " :" << queued.size() - shown << " more";
+            Replies::numeric(client, "249", os.str());
+        }
+    }
+    else if (letter == "u")
+    {
+        long up = (long)(std::time(0) - server.getStartTime());
+        std::ostringstream os;
+        os << nick << " :Server Up " << up / 86400 << " days, " << (up / 3600) % 24 << ":"
+           << (up / 600) % 6 << (up / 60) % 10 << ":" << (up % 60) / 10 << up % 10;
+        Replies::numeric(client, "242", os.str());
+    }
+    Replies::numeric(client, "219", nick + " " + letter + " :End of /STATS report");
+}
@@ -2,38 +2,71 @@
 #define COMMANDS_HPP
 
 #include <string>
+#include "IrcMessage.hpp"
 
 class Server;
 class Client;
+class Channel;
 
 struct Replies
 {
-    static void sendRaw(int fd, const std::string &raw);
-    static void notice(int fd, const std::string &msg);
-    static void numeric(int fd, const std::string &code, const std::string &msg);
+    static void sendRaw(Client &client, const std::string &raw);
+    static void notice(Client &client, const std::string &msg);
+    static void numeric(Client &client, const std::string &code, const std::string &msg);
+};
+
+typedef void (*CommandHandler)(Server &server, Client &client, const IrcMessage &msg);
+
+struct CommandSpec
+{
+    const char *name;
+    CommandHandler handler;
+    size_t minParams;
+    bool needsRegistration;
+    unsigned int floodCost;
+    // Reads or changes nicks, channels or other clients, so it runs under
+    // the server's state lock; the rest only touch the sending client.
+    bool shared;
 };
 
 class Commands
 {
     public:
-        static void pass(Server &server, Client &client, const std::string &args);
-        static void nick(Server &server, Client &client, const std::string &args);
-        static void user(Server &server, Client &client, const std::string &args);
-        static void join(Server &server, Client &client, const std::string &args);
-        static void privmsg(Server &server, Client &client, const std::string &args);
-        static void kick(Server &server, Client &client, const std::string &args);
-        static void invite(Server &server, Client &client, const std::string &args);
-        static void topic(Server &server, Client &client, const std::string &args);
-        static void mode(Server &server, Client &client, const std::string &args);
-
-        static void ping(Server &server, Client &client, const std::string &args);
-        static void cap(Server &server, Client &client, const std::string &args);
-        static void notice(Server &server, Client &client, const std::string &args);
-        static void who(Server &server, Client &client, const std::string &args);
-        static void names(Server &server, Client &client, const std::string &args);
-        static void quit(Server &server, Client &client, const std::string &args);
+        // Targets accepted per PRIVMSG/NOTICE, advertised as TARGMAX.
+        enum { MAX_TARGETS = 4 };
+        // Clients listed by STATS q.
+        enum { STATS_Q_MAX = 50 };
+
+        static void pass(Server &server, Client &client, const IrcMessage &msg);
+        static void nick(Server &server, Client &client, const IrcMessage &msg);
+        static void user(Server &server, Client &client, const IrcMessage &msg);
+        static void join(Server &server, Client &client, const IrcMessage &msg);
+        static void privmsg(Server &server, Client &client, const IrcMessage &msg);
+        static void kick(Server &server, Client &client, const IrcMessage &msg);
+        static void invite(Server &server, Client &client, const IrcMessage &msg);
+        static void topic(Server &server, Client &client, const IrcMessage &msg);
+        static void mode(Server &server, Client &client, const IrcMessage &msg);
+
+        static void ping(Server &server, Client &client, const IrcMessage &msg);
+        static void pong(Server &server, Client &client, const IrcMessage &msg);
+        static void cap(Server &server, Client &client, const IrcMessage &msg);
+        static void notice(Server &server, Client &client, const IrcMessage &msg);
+        static void who(Server &server, Client &client, const IrcMessage &msg);
+        static void names(Server &server, Client &client, const IrcMessage &msg);
+        static void quit(Server &server, Client &client, const IrcMessage &msg);
+
+        static void oper(Server &server, Client &client, const IrcMessage &msg);
+        static void stats(Server &server, Client &client, const IrcMessage &msg);
+
+        static const CommandSpec *lookup(const Slice &name);
+        static size_t count();
+        static const CommandSpec &at(size_t i);
+        // Runs one command and returns the flood penalty units it costs.
+        static unsigned int dispatch(Server &server, Client &client, const IrcMessage &msg);
+        static bool setFloodCost(const std::string &name, unsigned int cost);
 
         static void tryRegister(Server &server, Client &client);
+        static void sendNames(Client &client, Channel *ch, const std::string &chan);
 };
 
 #endif
@@ -0,0 +1,221 @@
+#include "Config.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+
+static const size_t DEFAULT_SENDQ_SOFT = 256 * 1024;
+static const size_t DEFAULT_SENDQ_HARD = 1024 * 1024;
+static const unsigned long DEFAULT_FLOOD_PENALTY = 500;
+static const unsigned long DEFAULT_FLOOD_BURST = 10000;
+static const size_t DEFAULT_FLOOD_EXCESS = 4096;
+static const unsigned long DEFAULT_PING_INTERVAL = 120 * 1000;
+static const unsigned long DEFAULT_PING_TIMEOUT = 60 * 1000;
+static const unsigned long DEFAULT_REGISTER_TIMEOUT = 30 * 1000;
+
+static std::string lineError(int lineNo, const std::string &what)
+{
+    std::ostringstream os;
+    os << "config line " << lineNo << ": " << what;
+    return os.str();
+}
+
+static unsigned long parseNumber(const std::string &value, int lineNo)
+{
+    char *end = 0;
+    unsigned long n = std::strtoul(value.c_str(), &end, 10);
+    if (end == value.c_str() || *end)
+        throw std::runtime_error(lineError(lineNo, "bad number '" + value + "'"));
+    return n;
+}
+
+static unsigned long parseDuration(const std::string &value, int lineNo)
+{
+    char *end = 0;
+    unsigned long n = std::strtoul(value.c_str(), &end, 10);
+    if (end == value.c_str())
+        throw std::runtime_error(lineError(lineNo, "bad time '" + value + "'"));
+    std::string unit(end);
+    if (unit == "s")
+        n *= 1000;
+    else if (unit == "m")
+        n *= 60 * 1000;
+    else if (!unit.empty() && unit != "ms")
+        throw std::runtime_error(lineError(lineNo, "bad time '" + value + "'"));
+    return n;
+}
+
+static size_t parseSize(const std::string &value, int lineNo)
+{
+    char *end = 0;
+    unsigned long n = std::strtoul(value.c_str(), &end, 10);
+    if (end == value.c_str())
+        throw std::runtime_error(lineError(lineNo, "bad size '" + value + "'"));
+    if (*end == 'k' || *end == 'K')
+        n *= 1024, ++end;
+    else if (*end == 'm' || *end == 'M')
+        n *= 1024 * 1024, ++end;
+    if (*end)
+        throw std::runtime_error(lineError(lineNo, "bad size '" + value + "'"));
+    return n;
+}
+
+Config::Config()
+: _captureAnonymized(false), _snapshotInterval(5 * 60 * 1000)
+{
+    ConnClass def;
+    def.name = "default";
+    def.sendqSoft = DEFAULT_SENDQ_SOFT;
+    def.sendqHard = DEFAULT_SENDQ_HARD;
+    def.floodPenalty = DEFAULT_FLOOD_PENALTY;
+    def.floodBurst = DEFAULT_FLOOD_BURST;
+    def.floodExcess = DEFAULT_FLOOD_EXCESS;
+    def.pingInterval = DEFAULT_PING_INTERVAL;
+    def.pingTimeout = DEFAULT_PING_TIMEOUT;
+    def.registerTimeout = DEFAULT_REGISTER_TIMEOUT;
+    _classes.push_back(def);
+}
+
+ConnClass &Config::classNamed(const std::string &name)
+{
+    for (size_t i = 0; i < _classes.size(); ++i)
+        if (_classes[i].name == name)
+            return _classes[i];
+    ConnClass c = _classes[0];
+    c.name = name;
+    c.from.clear();
+    _classes.push_back(c);
+    return _classes.back();
+}
+
+void Config::parseClass(const std::vector<std::string> &words, int lineNo)
+{
+    if (words.size() < 2)
+        throw std::runtime_error(lineError(lineNo, "class needs a name"));
+    ConnClass &c = classNamed(words[1]);
+    for (size_t i = 2; i < words.size(); ++i)
+    {
+        std::string::size_type eq = words[i].find('=');
+        if (eq == std::string::npos)
+            throw std::runtime_error(lineError(lineNo, "expected key=value, got '" + words[i] + "'"));
+        std::string key = words[i].substr(0, eq);
+        std::string value = words[i].substr(eq + 1);
+        if (key == "from")
+            c.from = value;
+        else if (key == "sendq_soft")
+            c.sendqSoft = parseSize(value, lineNo);
+        else if (key == "sendq_hard")
+            c.sendqHard = parseSize(value, lineNo);
+        else if (key == "flood_penalty")
+            c.floodPenalty = parseDuration(value, lineNo);
+        else if (key == "flood_burst")
+            c.floodBurst = parseDuration(value, lineNo);
+        else if (key == "flood_excess")
+            c.floodExcess = parseSize(value, lineNo);
+        else if (key == "ping_interval")
+            c.pingInterval = parseDuration(value, lineNo);
+        else if (key == "ping_timeout")
+            c.pingTimeout = parseDuration(value, lineNo);
+        else if (key == "register_timeout")
+            c.registerTimeout = parseDuration(value, lineNo);
+        else
+            throw std::runtime_error(lineError(lineNo, "unknown class option '" + key + "'"));
+    }
+    if (c.sendqSoft > c.sendqHard)
+        throw std::runtime_error(lineError(lineNo, "sendq_soft is above sendq_hard"));
+}
+
+void Config::load(const std::string &path)
+{
+    std::ifstream in(path.c_str());
+    if (!in)
+        throw std::runtime_error("cannot open config " + path);
+
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(in, line))
+    {
+        ++lineNo;
+        std::string::size_type hash = line.find('#');
+        if (hash != std::string::npos)
+            line.erase(hash);
+
+        std::istringstream ss(line);
+        std::vector<std::string> words;
+        std::string w;
+        while (ss >> w)
+            words.push_back(w);
+        if (words.empty())
+            continue;
+
+        if (words[0] == "class")
+            parseClass(words, lineNo);
+        else if (words[0] == "flood_cost")
+        {
+            if (words.size() != 3)
+                throw std::runtime_error(lineError(lineNo, "usage: flood_cost <command> <cost>"));
+            FloodCost fc;
+            fc.command = words[1];
+            fc.cost = parseNumber(words[2], lineNo);
+            _floodCosts.push_back(fc);
+        }
+        else if (words[0] == "oper")
+        {
+            if (words.size() != 3)
+                throw std::runtime_error(lineError(lineNo, "usage: oper <name> <password>"));
+            OperBlock op;
+            op.name = words[1];
+            op.password = words[2];
+            _opers.push_back(op);
+        }
+        else if (words[0] == "metrics_socket")
+        {
+            if (words.size() != 2)
+                throw std::runtime_error(lineError(lineNo, "usage: metrics_socket <path>"));
+            _metricsSocket = words[1];
+        }
+        else if (words[0] == "capture")
+        {
+            if (words.size() < 2 || words.size() > 3 || (words.size() == 3 && words[2] != "anonymize"))
+                throw std::runtime_error(lineError(lineNo, "usage: capture <path> [anonymize]"));
+            _capturePath = words[1];
+            _captureAnonymized = words.size() == 3;
+        }
+        else if (words[0] == "snapshot")
+        {
+            if (words.size() < 2 || words.size() > 3)
+                throw std::runtime_error(lineError(lineNo, "usage: snapshot <path> [interval]"));
+            _snapshotPath = words[1];
+            if (words.size() == 3)
+                _snapshotInterval = parseDuration(words[2], lineNo);
+        }
+        else
+            throw std::runtime_error(lineError(lineNo, "unknown directive '" + words[0] + "'"));
+    }
+}
+
+const ConnClass &Config::classFor(const std::string &address) const
+{
+    const ConnClass *best = &_classes[0];
+    size_t bestLen = 0;
+    for (size_t i = 1; i < _classes.size(); ++i)
+    {
+        const std::string &from = _classes[i].from;
+        if (from.empty() || from.size() <= bestLen)
+            continue;
+        if (address.compare(0, from.size(), from) == 0)
+        {
+            best = &_classes[i];
+            bestLen = from.size();
+        }
+    }
+    return *best;
+}
+
+const OperBlock *Config::findOper(const std::string &name) const
+{
+    for (size_t i = 0; i < _opers.size(); ++i)
+        if (_opers[i].name == name)
+            return &_opers[i];
+    return 0;
+}
@@ -0,0 +1,91 @@
+#ifndef CONFIG_HPP
+#define CONFIG_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// Limits applied to every connection that falls into a class. A client
+// is placed in the class whose `from` prefix is the longest match for
+// its address; "default" matches everything.
+struct ConnClass
+{
+    std::string name;
+    std::string from;
+    size_t sendqSoft;
+    size_t sendqHard;
+    unsigned long floodPenalty;
+    unsigned long floodBurst;
+    size_t floodExcess;
+    unsigned long pingInterval;
+    unsigned long pingTimeout;
+    unsigned long registerTimeout;
+};
+
+struct OperBlock
+{
+    std::string name;
+    std::string password;
+};
+
+struct FloodCost
+{
+    std::string command;
+    unsigned int cost;
+};
+
+// Server configuration loaded from a plain text file, one directive per
+// line, '#' starts a comment:
+//
+//   class <name> [from=<ip prefix>] [sendq_soft=<size>] [sendq_hard=<size>]
+//                [flood_penalty=<time>] [flood_burst=<time>] [flood_excess=<size>]
+//                [ping_interval=<time>] [ping_timeout=<time>]
+//                [register_timeout=<time>]
+//   flood_cost <command> <cost>
+//   oper <name> <password>
+//   metrics_socket <path>
+//   capture <path> [anonymize]
+//   snapshot <path> [interval]
+//
+// Sizes accept a k or m suffix; times are milliseconds unless given an
+// s or m suffix. A client idle for ping_interval is sent a PING and is
+// dropped if nothing arrives within ping_timeout; connections that have
+// not registered after register_timeout are dropped. Each command adds cost * flood_penalty
+// to a client's penalty clock; once the clock runs more than flood_burst
+// ahead of real time its input is parked. A flood_penalty of 0 disables
+// this, and a flood_excess of 0 never disconnects for Excess Flood.
+// capture records connections and inbound lines for bench/ircreplay.
+// snapshot saves channel state every interval (default 5m, 0 for only
+// on shutdown) and restores it at startup.
+class Config
+{
+    private:
+        std::vector<ConnClass> _classes;
+        std::vector<FloodCost> _floodCosts;
+        std::vector<OperBlock> _opers;
+        std::string _metricsSocket;
+        std::string _capturePath;
+        bool _captureAnonymized;
+        std::string _snapshotPath;
+        unsigned long _snapshotInterval;
+
+        ConnClass &classNamed(const std::string &name);
+        void parseClass(const std::vector<std::string> &words, int lineNo);
+
+    public:
+        Config();
+
+        void load(const std::string &path);
+
+        const ConnClass &classFor(const std::string &address) const;
+        const std::vector<ConnClass> &getClasses() const { return _classes; }
+        const std::vector<FloodCost> &getFloodCosts() const { return _floodCosts; }
+        const OperBlock *findOper(const std::string &name) const;
+        const std::string &getMetricsSocket() const { return _metricsSocket; }
+        const std::string &getCapturePath() const { return _capturePath; }
+        bool captureAnonymized() const { return _captureAnonymized; }
+        const std::string &getSnapshotPath() const { return _snapshotPath; }
+        unsigned long getSnapshotInterval() const { return _snapshotInterval; }
+};
+
+#endif
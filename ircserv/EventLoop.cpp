@@ -0,0 +1,743 @@
+#include "EventLoop.hpp"
+#include "Server.hpp"
+#include "Commands.hpp"
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef __linux__
+# include <sys/eventfd.h>
+#endif
+
+static __thread EventLoop *s_current = 0;
+
+EventLoop::EventLoop(Server &server, int id, const std::string &backend)
+: _server(server), _id(id), _listen_fd(-1), _wake_fd(-1), _wake_wr(-1),
+  _wakePending(0), _reserve_fd(open("/dev/null", O_RDONLY | O_CLOEXEC)),
+  _poller(Poller::create(backend)), _now(monotonicMs()),
+  _timers(_now), _metrics_fd(-1), _thread(), _threaded(false)
+{
+#ifdef __linux__
+    _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    _wake_wr = _wake_fd;
+#else
+    int fds[2];
+    if (pipe(fds) == 0)
+    {
+        _wake_fd = fds[0];
+        _wake_wr = fds[1];
+        fcntl(_wake_fd, F_SETFL, O_NONBLOCK);
+        fcntl(_wake_wr, F_SETFL, O_NONBLOCK);
+    }
+#endif
+    if (_wake_fd < 0)
+    {
+        if (_reserve_fd >= 0)
+            close(_reserve_fd);
+        delete _poller;
+        throw std::runtime_error("wakeup fd failed");
+    }
+    _poller->add(_wake_fd, Poller::READABLE, false);
+    if (server.capture().isOpen())
+        _capture.attach(&server.capture());
+}
+
+EventLoop::~EventLoop()
+{
+    closeAll();
+    for (size_t fd = 0; fd < _slots.size(); ++fd)
+        delete _slots[fd].client;
+    if (_wake_wr != _wake_fd)
+        close(_wake_wr);
+    close(_wake_fd);
+    if (_reserve_fd >= 0)
+        close(_reserve_fd);
+    delete _poller;
+}
+
+EventLoop *EventLoop::current()
+{
+    return s_current;
+}
+
+unsigned long EventLoop::monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void EventLoop::listen(int port, bool reusePort)
+{
+    _listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (_listen_fd < 0)
+        throw std::runtime_error("socket failed");
+
+    int opt = 1;
+    setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reusePort)
+    {
+#ifdef SO_REUSEPORT
+        if (setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+            throw std::runtime_error("SO_REUSEPORT failed");
+#else
+        throw std::runtime_error("SO_REUSEPORT is not supported");
+#endif
+    }
+
+    sockaddr_in addr; std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        throw std::runtime_error("bind failed");
+    if (::listen(_listen_fd, 128) < 0)
+        throw std::runtime_error("listen failed");
+    fcntl(_listen_fd, F_SETFL, O_NONBLOCK);
+
+    _poller->add(_listen_fd, Poller::READABLE, true);
+}
+
+// Local Prometheus scrape endpoint: every connection gets one HTTP/1.0
+// response with the current metrics and is closed.
+void EventLoop::listenMetrics(const std::string &path)
+{
+    sockaddr_un addr; std::memset(&addr, 0, sizeof(addr));
+    if (path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("metrics socket path too long");
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    _metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_metrics_fd < 0)
+        throw std::runtime_error("metrics socket failed");
+    unlink(path.c_str());
+    if (bind(_metrics_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        throw std::runtime_error("metrics bind failed");
+    if (::listen(_metrics_fd, 16) < 0)
+        throw std::runtime_error("metrics listen failed");
+    fcntl(_metrics_fd, F_SETFL, O_NONBLOCK);
+    _poller->add(_metrics_fd, Poller::READABLE, true);
+}
+
+// Scrapes never block the loop: each one is polled like a client and
+// closed after SCRAPE_TIMEOUT_MS whatever state it is in. Past
+// SCRAPES_MAX open ones, new connections are dropped.
+void EventLoop::serveMetrics()
+{
+    while (true)
+    {
+        int cfd = accept(_metrics_fd, 0, 0);
+        if (cfd < 0)
+            return;
+        if (_scrapes.size() >= SCRAPES_MAX)
+        {
+            close(cfd);
+            continue;
+        }
+        fcntl(cfd, F_SETFL, O_NONBLOCK);
+        std::string body;
+        _server.renderMetrics(body);
+        std::ostringstream head;
+        head << "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             << "Content-Length: " << body.size() << "\r\n\r\n";
+
+        MetricsConn *conn = new MetricsConn;
+        conn->fd = cfd;
+        conn->reply = head.str() + body;
+        conn->sent = 0;
+        conn->loop = this;
+        conn->timer.setCallback(&EventLoop::onScrapeTimeout, conn);
+        _timers.schedule(conn->timer, _now + SCRAPE_TIMEOUT_MS);
+        _scrapes.push_back(conn);
+        _poller->add(cfd, Poller::READABLE | Poller::WRITABLE, false);
+        serveScrape(conn, Poller::WRITABLE);
+    }
+}
+
+MetricsConn *EventLoop::findScrape(int fd) const
+{
+    for (size_t i = 0; i < _scrapes.size(); ++i)
+        if (_scrapes[i]->fd == fd)
+            return _scrapes[i];
+    return 0;
+}
+
+void EventLoop::serveScrape(MetricsConn *conn, int events)
+{
+    if ((events & Poller::WRITABLE) && conn->sent < conn->reply.size())
+    {
+        ssize_t n = send(conn->fd, conn->reply.data() + conn->sent,
+                         conn->reply.size() - conn->sent, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            closeScrape(conn);
+            return;
+        }
+        if (n > 0)
+            conn->sent += n;
+        if (conn->sent == conn->reply.size())
+        {
+            shutdown(conn->fd, SHUT_WR);
+            _poller->modify(conn->fd, Poller::READABLE);
+        }
+    }
+    // Closing a unix socket with the request still unread resets the
+    // peer before it sees the reply, so drain what the scraper sent.
+    if (events & (Poller::READABLE | Poller::HANGUP))
+    {
+        char sink[512];
+        ssize_t n;
+        while ((n = recv(conn->fd, sink, sizeof(sink), 0)) > 0)
+            ;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            closeScrape(conn);
+    }
+}
+
+void EventLoop::closeScrape(MetricsConn *conn)
+{
+    _poller->remove(conn->fd);
+    close(conn->fd);
+    _scrapes.erase(std::find(_scrapes.begin(), _scrapes.end(), conn));
+    delete conn;
+}
+
+void EventLoop::onScrapeTimeout(Timer &, void *arg)
+{
+    MetricsConn *conn = static_cast<MetricsConn*>(arg);
+    conn->loop->closeScrape(conn);
+}
+
+void EventLoop::closeAll()
+{
+    if (_listen_fd >= 0)
+    {
+        _poller->remove(_listen_fd);
+        close(_listen_fd);
+        _listen_fd = -1;
+    }
+    if (_metrics_fd >= 0)
+    {
+        _poller->remove(_metrics_fd);
+        close(_metrics_fd);
+        _metrics_fd = -1;
+    }
+    while (!_scrapes.empty())
+        closeScrape(_scrapes.back());
+    for (size_t fd = 0; fd < _slots.size(); ++fd)
+    {
+        if (_slots[fd].client && _slots[fd].interest)
+        {
+            _poller->remove((int)fd);
+            close((int)fd);
+            _slots[fd].interest = 0;
+        }
+    }
+}
+
+void EventLoop::closeInChild() const
+{
+    int wakeWr = _wake_wr != _wake_fd ? _wake_wr : -1;
+    int own[] = { _listen_fd, _metrics_fd, _wake_fd, wakeWr, _reserve_fd, _poller->descriptor() };
+    for (size_t i = 0; i < sizeof(own) / sizeof(own[0]); ++i)
+        if (own[i] >= 0)
+            close(own[i]);
+    for (size_t i = 0; i < _scrapes.size(); ++i)
+        close(_scrapes[i]->fd);
+    for (size_t fd = 0; fd < _slots.size(); ++fd)
+        if (_slots[fd].client && _slots[fd].interest)
+            close((int)fd);
+}
+
+void *EventLoop::threadMain(void *arg)
+{
+    static_cast<EventLoop*>(arg)->run();
+    return 0;
+}
+
+void EventLoop::spawn()
+{
+    if (pthread_create(&_thread, 0, &EventLoop::threadMain, this) != 0)
+        throw std::runtime_error("pthread_create failed");
+    _threaded = true;
+}
+
+void EventLoop::join()
+{
+    if (_threaded)
+        pthread_join(_thread, 0);
+    _threaded = false;
+}
+
+// The listener is edge-triggered, so the backlog has to be drained on
+// every wakeup: transient errors retry, and when descriptors run out the
+// reserve fd is given up to accept and close the pending connections
+// instead of leaving them queued with no new edge to come.
+void EventLoop::acceptNewClient()
+{
+    while (true)
+    {
+        sockaddr_in cli; socklen_t len = sizeof(cli);
+        int cfd = accept(_listen_fd, (struct sockaddr*)&cli, &len);
+        if (cfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+                continue;
+            if ((errno == EMFILE || errno == ENFILE) && _reserve_fd >= 0)
+            {
+                close(_reserve_fd);
+                int dropped = accept(_listen_fd, 0, 0);
+                if (dropped >= 0)
+                    close(dropped);
+                _reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (dropped >= 0)
+                {
+                    std::cout << "[Server] Out of file descriptors, dropped a connection" << std::endl;
+                    continue;
+                }
+            }
+            return;
+        }
+        fcntl(cfd, F_SETFL, O_NONBLOCK);
+        int one = 1;
+        setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        _poller->add(cfd, Poller::READABLE, true);
+        char addr[INET_ADDRSTRLEN] = "";
+        inet_ntop(AF_INET, &cli.sin_addr, addr, sizeof(addr));
+        Client *cl = new Client(cfd, this, _server.nextClientId());
+        const ConnClass &cls = _server.getConfig().classFor(addr);
+        cl->setClass(&cls);
+        cl->touch(_now);
+        cl->pingTimer().setCallback(&EventLoop::onPingTimer, cl);
+        cl->registerTimer().setCallback(&EventLoop::onRegisterTimeout, cl);
+        cl->floodTimer().setCallback(&EventLoop::onFloodResume, cl);
+        if (cls.pingInterval)
+            _timers.schedule(cl->pingTimer(), _now + cls.pingInterval);
+        if (cls.registerTimeout)
+            _timers.schedule(cl->registerTimer(), _now + cls.registerTimeout);
+        {
+            // Other loops walk the slot table under the state lock.
+            StateGuard guard(_server);
+            if ((size_t)cfd >= _slots.size())
+            {
+                ClientSlot empty = { 0, 0 };
+                _slots.resize(cfd + 1, empty);
+            }
+            _slots[cfd].client = cl;
+            _slots[cfd].interest = Poller::READABLE;
+        }
+        Metrics::add(_metrics.connectionsAccepted);
+        if (_capture.enabled())
+            _capture.connect(cl->getId());
+        std::cout << "[Server] Client connected fd=" << cfd << " from " << addr
+                  << " class=" << cl->getClass()->name << std::endl;
+    }
+}
+
+void EventLoop::collectClients(std::vector<Client*> &out) const
+{
+    for (size_t fd = 0; fd < _slots.size(); ++fd)
+    {
+        if (_slots[fd].client)
+            out.push_back(_slots[fd].client);
+    }
+}
+
+void EventLoop::adoptListener(int fd)
+{
+    _listen_fd = fd;
+    fcntl(_listen_fd, F_SETFL, O_NONBLOCK);
+    _poller->add(_listen_fd, Poller::READABLE, true);
+}
+
+// Timers are re-armed from the client's own timestamps, which stay valid
+// across processes because they come from the monotonic clock. Input
+// that was already read goes through the flood-resume path, so it is
+// processed without waiting for more data on the socket.
+void EventLoop::adoptClient(Client *cl)
+{
+    int fd = cl->getFd();
+    _poller->add(fd, Poller::READABLE, true);
+    if ((size_t)fd >= _slots.size())
+    {
+        ClientSlot empty = { 0, 0 };
+        _slots.resize(fd + 1, empty);
+    }
+    _slots[fd].client = cl;
+    _slots[fd].interest = Poller::READABLE;
+
+    const ConnClass *cls = cl->getClass();
+    cl->pingTimer().setCallback(&EventLoop::onPingTimer, cl);
+    cl->registerTimer().setCallback(&EventLoop::onRegisterTimeout, cl);
+    cl->floodTimer().setCallback(&EventLoop::onFloodResume, cl);
+    if (cls->pingInterval)
+    {
+        bool awaiting = cl->pingSentAt() && cl->lastActive() < cl->pingSentAt();
+        unsigned long due = awaiting ? cl->pingSentAt() + cls->pingTimeout
+                                     : cl->lastActive() + cls->pingInterval;
+        _timers.schedule(cl->pingTimer(), due);
+    }
+    if (!cl->isAuthenticated() && cls->registerTimeout)
+        _timers.schedule(cl->registerTimer(), _now + cls->registerTimeout);
+    if (cl->isParked() || cl->getInput().size())
+    {
+        cl->setParked(true);
+        updatePoller(fd);
+        unsigned long resume = cl->floodResumeAt();
+        _timers.schedule(cl->floodTimer(), resume > _now ? resume : _now);
+    }
+}
+
+void EventLoop::receiveClientMessage(int fd)
+{
+    Client *cl = getClientByFd(fd);
+    if (!cl || cl->isClosing())
+        return;
+
+    while (true)
+    {
+        if (!processLines(*cl))
+            return;
+
+        InputBuffer &in = cl->getInput();
+        size_t room = in.writable();
+        if (cl->isParked())
+        {
+            size_t excess = cl->getClass()->floodExcess;
+            if (excess && in.size() >= excess)
+            {
+                cl->markClosing("Excess Flood");
+                return;
+            }
+            // Leave the rest in the socket; resumeParked() reads it.
+            if (room == 0)
+                return;
+        }
+
+        ssize_t n = recv(fd, in.writePtr(), room, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0)
+        {
+            std::cout << "[Server] Client disconnected fd=" << fd << std::endl;
+            removeClient(fd);
+            return;
+        }
+        in.commit(static_cast<size_t>(n));
+        cl->touch(_now);
+        Metrics::add(_metrics.bytesIn, n);
+    }
+}
+
+bool EventLoop::processLines(Client &client)
+{
+    int fd = client.getFd();
+    Slice line;
+
+    while (true)
+    {
+        if (client.floodBlocked(_now))
+        {
+            park(client);
+            return true;
+        }
+        InputBuffer::LineStatus st = client.extractLine(line);
+        if (st == InputBuffer::LINE_PARTIAL)
+            return true;
+        if (st == InputBuffer::LINE_TOO_LONG)
+        {
+            std::cout << "[Server] Input line too long fd=" << fd << std::endl;
+            client.queueSend(std::string("ERROR :Input line too long\r\n"));
+            client.flushSend();
+            removeClient(fd);
+            return false;
+        }
+        if (line.empty())
+            continue;
+        if (_capture.enabled())
+            _capture.line(client.getId(), line);
+
+        unsigned int cost = handleCommand(client, line);
+        if (getClientByFd(fd) != &client || client.isClosing())
+            return false;
+        client.chargeFlood(cost, _now);
+    }
+}
+
+unsigned int EventLoop::handleCommand(Client &client, const Slice &line)
+{
+    IrcMessage msg;
+    if (!parseMessage(line, msg))
+        return 1;
+
+    return Commands::dispatch(_server, client, msg);
+}
+
+void EventLoop::park(Client &client)
+{
+    if (client.isParked())
+        return;
+    client.setParked(true);
+    updatePoller(client.getFd());
+    _timers.schedule(client.floodTimer(), client.floodResumeAt());
+}
+
+// Edge-triggered readiness will not fire again for data already in the
+// socket, so the resume path reads as well as running buffered lines.
+void EventLoop::onFloodResume(Timer &, void *arg)
+{
+    Client *c = static_cast<Client*>(arg);
+    EventLoop *loop = c->getLoop();
+    c->setParked(false);
+    loop->updatePoller(c->getFd());
+    loop->receiveClientMessage(c->getFd());
+}
+
+void EventLoop::onRegisterTimeout(Timer &, void *arg)
+{
+    Client *c = static_cast<Client*>(arg);
+    if (!c->isAuthenticated())
+        c->markClosing("Registration timeout");
+}
+
+// Activity only moves lastActive; the timer catches up lazily when it
+// fires instead of being re-armed for every line.
+void EventLoop::onPingTimer(Timer &timer, void *arg)
+{
+    Client *c = static_cast<Client*>(arg);
+    EventLoop *loop = c->getLoop();
+    const ConnClass *cls = c->getClass();
+    unsigned long now = loop->_now;
+
+    if (c->pingSentAt() && c->lastActive() < c->pingSentAt())
+    {
+        std::ostringstream reason;
+        reason << "Ping timeout: " << (now - c->lastActive()) / 1000 << " seconds";
+        c->markClosing(reason.str());
+        return;
+    }
+    if (now - c->lastActive() >= cls->pingInterval)
+    {
+        c->queueSend(std::string("PING :ircserv\r\n"));
+        c->setPingSentAt(now);
+        loop->_timers.schedule(timer, now + cls->pingTimeout);
+        return;
+    }
+    c->setPingSentAt(0);
+    loop->_timers.schedule(timer, c->lastActive() + cls->pingInterval);
+}
+
+Client* EventLoop::getClientByFd(int fd)
+{
+    if (fd < 0 || (size_t)fd >= _slots.size())
+        return 0;
+    return _slots[fd].client;
+}
+
+void EventLoop::setInterest(int fd, int interest)
+{
+    if (!getClientByFd(fd) || _slots[fd].interest == interest)
+        return;
+    _slots[fd].interest = interest;
+    updatePoller(fd);
+}
+
+// A parked client is not polled for input: with a level-triggered
+// backend its unread data would wake the loop on every pass.
+void EventLoop::updatePoller(int fd)
+{
+    int interest = _slots[fd].interest;
+    if (_slots[fd].client->isParked())
+        interest &= ~Poller::READABLE;
+    _poller->modify(fd, interest);
+}
+
+void EventLoop::enableWrite(int fd)
+{
+    setInterest(fd, Poller::READABLE | Poller::WRITABLE);
+}
+
+void EventLoop::disableWrite(int fd)
+{
+    setInterest(fd, Poller::READABLE);
+}
+
+void EventLoop::markDirty(Client &client)
+{
+    if (client.isDirty())
+        return;
+    client.setDirty(true);
+    _dirty.push_back(client.getFd());
+}
+
+// Whatever could not be sent inline during one iteration goes out in a
+// single writev per client; only clients whose socket filled up stay
+// armed for writability.
+void EventLoop::flushDirty()
+{
+    for (size_t i = 0; i < _dirty.size(); ++i)
+    {
+        Client *c = getClientByFd(_dirty[i]);
+        if (!c || !c->isDirty())
+            continue;
+        c->setDirty(false);
+        c->flushSend();
+    }
+    _dirty.clear();
+}
+
+void EventLoop::removeClient(int fd)
+{
+    Client* victim = getClientByFd(fd);
+    if (!victim)
+        return;
+
+    _poller->remove(fd);
+    close(fd);
+    Metrics::add(_metrics.connectionsClosed);
+    if (_capture.enabled())
+        _capture.close(victim->getId());
+
+    {
+        StateGuard guard(_server);
+        _slots[fd].client = 0;
+        _slots[fd].interest = 0;
+        _server.detachClient(victim);
+    }
+    delete victim;
+}
+
+void EventLoop::scheduleClose(int fd)
+{
+    _closing.push_back(fd);
+}
+
+void EventLoop::reapClosing()
+{
+    while (!_closing.empty())
+    {
+        std::vector<int> fds;
+        fds.swap(_closing);
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            Client *c = getClientByFd(fds[i]);
+            if (!c || !c->isClosing())
+                continue;
+            c->flushSend();
+            std::cout << "[Server] Closing fd=" << fds[i] << ": " << c->closeReason() << std::endl;
+            removeClient(fds[i]);
+        }
+    }
+}
+
+void EventLoop::post(Client *client, const SharedBuffer &data, int priority)
+{
+    Delivery *d = new Delivery;
+    d->fd = client->getFd();
+    d->clientId = client->getId();
+    d->priority = priority;
+    d->data = data;
+    _mailbox.push(d);
+    wake();
+}
+
+void EventLoop::wake()
+{
+    if (__atomic_exchange_n(&_wakePending, 1, __ATOMIC_ACQ_REL))
+        return;
+#ifdef __linux__
+    uint64_t one = 1;
+#else
+    char one = 1;
+#endif
+    ssize_t n = write(_wake_wr, &one, sizeof(one));
+    (void)n;
+}
+
+void EventLoop::drainMailbox()
+{
+    char buf[64];
+    while (read(_wake_fd, buf, sizeof(buf)) > 0)
+        ;
+    __atomic_store_n(&_wakePending, 0, __ATOMIC_RELEASE);
+
+    while (Delivery *d = _mailbox.pop())
+    {
+        Client *c = getClientByFd(d->fd);
+        if (c && c->getId() == d->clientId)
+            c->queueSend(d->data, d->priority);
+        delete d;
+    }
+}
+
+void EventLoop::run()
+{
+    s_current = this;
+    Metrics::setCurrent(&_metrics);
+    std::vector<Poller::Event> ready;
+    while (_server.isRunning())
+    {
+        int n = _poller->wait(ready, _timers.timeoutMs(monotonicMs()));
+        _now = monotonicMs();
+
+        for (int i = 0; i < n && _server.isRunning(); ++i)
+        {
+            int fd = ready[i].fd;
+            int rev = ready[i].events;
+
+            if (fd == _listen_fd)
+            {
+                acceptNewClient();
+                continue;
+            }
+            if (fd == _wake_fd)
+            {
+                drainMailbox();
+                continue;
+            }
+            if (fd == _metrics_fd)
+            {
+                serveMetrics();
+                continue;
+            }
+            if (MetricsConn *conn = findScrape(fd))
+            {
+                serveScrape(conn, rev);
+                continue;
+            }
+            if (rev & (Poller::READABLE | Poller::HANGUP))
+                receiveClientMessage(fd);
+            if (rev & Poller::WRITABLE)
+            {
+                Client* c = getClientByFd(fd);
+                if (c)
+                    c->flushSend();
+            }
+        }
+        _timers.advance(_now);
+        flushDirty();
+        reapClosing();
+        if (_capture.enabled())
+            _capture.maybeFlush(_now);
+    }
+    drainMailbox();
+    flushDirty();
+    _capture.flush();
+    Metrics::setCurrent(0);
+    s_current = 0;
+}
@@ -0,0 +1,135 @@
+#ifndef EVENTLOOP_HPP
+#define EVENTLOOP_HPP
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "Poller.hpp"
+#include "Mailbox.hpp"
+#include "Slice.hpp"
+#include "TimerWheel.hpp"
+#include "Metrics.hpp"
+#include "Capture.hpp"
+
+class Server;
+class Client;
+class EventLoop;
+
+struct ClientSlot
+{
+    Client *client;
+    int interest;
+};
+
+// A scrape being answered: the reply goes out as the socket takes it,
+// then the request is read and dropped until the peer closes.
+struct MetricsConn
+{
+    int fd;
+    std::string reply;
+    size_t sent;
+    EventLoop *loop;
+    Timer timer;
+};
+
+// One reactor: its own listening socket, poller and clients. Clients are
+// only ever touched by the thread running their loop; other loops reach
+// them through post().
+class EventLoop
+{
+    private:
+        Server &_server;
+        int _id;
+        int _listen_fd;
+        int _wake_fd;
+        int _wake_wr;
+        int _wakePending;
+        // Held open so a connection can still be accepted and dropped
+        // when the process runs out of descriptors.
+        int _reserve_fd;
+        Poller *_poller;
+        std::vector<ClientSlot> _slots;
+        Mailbox _mailbox;
+        std::vector<int> _closing;
+        std::vector<int> _dirty;
+        unsigned long _now;
+        TimerWheel _timers;
+        Metrics _metrics;
+        int _metrics_fd;
+        std::vector<MetricsConn*> _scrapes;
+        CaptureWriter _capture;
+        pthread_t _thread;
+        bool _threaded;
+
+        EventLoop(const EventLoop &);
+        EventLoop &operator=(const EventLoop &);
+
+        void acceptNewClient();
+        void receiveClientMessage(int fd);
+        bool processLines(Client &client);
+        unsigned int handleCommand(Client &client, const Slice &line);
+        void park(Client &client);
+        void serveMetrics();
+        MetricsConn *findScrape(int fd) const;
+        void serveScrape(MetricsConn *conn, int events);
+        void closeScrape(MetricsConn *conn);
+        void drainMailbox();
+        void reapClosing();
+        void flushDirty();
+        void setInterest(int fd, int interest);
+        void updatePoller(int fd);
+
+        static void *threadMain(void *arg);
+        static void onPingTimer(Timer &timer, void *arg);
+        static void onRegisterTimeout(Timer &timer, void *arg);
+        static void onFloodResume(Timer &timer, void *arg);
+        static void onScrapeTimeout(Timer &timer, void *arg);
+
+    public:
+        enum { SCRAPES_MAX = 16, SCRAPE_TIMEOUT_MS = 1000 };
+
+        EventLoop(Server &server, int id, const std::string &backend);
+        ~EventLoop();
+
+        static EventLoop *current();
+        static unsigned long monotonicMs();
+
+        int getId() const { return _id; }
+        const char *backendName() const { return _poller->name(); }
+        Server &getServer() { return _server; }
+        unsigned long now() const { return _now; }
+        TimerWheel &timers() { return _timers; }
+        Metrics &metrics() { return _metrics; }
+
+        void listen(int port, bool reusePort);
+        int listenFd() const { return _listen_fd; }
+        void listenMetrics(const std::string &path);
+        void run();
+        void spawn();
+        void join();
+        void wake();
+        void closeAll();
+        // In a forked child: closes every descriptor the loop owns and
+        // leaves its state, and the parent's poller, alone.
+        void closeInChild() const;
+
+        // Every client of this loop. Other loops may call it while they
+        // hold the state lock, which guards changes to the slot table.
+        void collectClients(std::vector<Client*> &out) const;
+        // Hot upgrade: taking over a listener or a client handed over by
+        // the previous process.
+        void adoptListener(int fd);
+        void adoptClient(Client *client);
+
+        Client* getClientByFd(int fd);
+        void removeClient(int fd);
+        void enableWrite(int fd);
+        void disableWrite(int fd);
+        void markDirty(Client &client);
+
+        void scheduleClose(int fd);
+
+        void post(Client *client, const SharedBuffer &data, int priority);
+};
+
+#endif
@@ -0,0 +1,477 @@
+#include "Handoff.hpp"
+#include "Server.hpp"
+#include "Codec.hpp"
+#include <iostream>
+#include <stdexcept>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static const char MAGIC[] = "IRCHOFF1";
+static const size_t MAGIC_LEN = sizeof(MAGIC) - 1;
+// Magic, last client id, capture start and salt, listener and client count.
+static const size_t HEADER_LEN = MAGIC_LEN + 3 * 8 + 2 * 4;
+
+enum
+{
+    FLAG_AUTHENTICATED = 1,
+    FLAG_PASS_OK = 2,
+    FLAG_REGISTERED = 4,
+    FLAG_OPER = 8,
+    FLAG_PARKED = 16
+};
+
+enum
+{
+    CHANNEL_INVITE_ONLY = 1,
+    CHANNEL_TOPIC_RESTRICTED = 2
+};
+
+static bool sendAll(int fd, const char *p, size_t n)
+{
+    while (n)
+    {
+        ssize_t w = ::send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+static bool recvAll(int fd, char *p, size_t n)
+{
+    while (n)
+    {
+        ssize_t r = ::recv(fd, p, n, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static bool sendFds(int sock, const std::vector<int> &fds)
+{
+    for (size_t done = 0; done < fds.size(); )
+    {
+        unsigned int n = (unsigned int)(fds.size() - done);
+        if (n > Handoff::FDS_PER_MESSAGE)
+            n = Handoff::FDS_PER_MESSAGE;
+
+        std::vector<char> control(CMSG_SPACE(n * sizeof(int)));
+        struct iovec iov = { &n, sizeof(n) };
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fds[done], n * sizeof(int));
+
+        ssize_t w;
+        do
+            w = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        while (w < 0 && errno == EINTR);
+        if (w != (ssize_t)sizeof(n))
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+static bool recvFds(int sock, std::vector<int> &fds, size_t want)
+{
+    while (fds.size() < want)
+    {
+        unsigned int n = 0;
+        std::vector<char> control(CMSG_SPACE(Handoff::FDS_PER_MESSAGE * sizeof(int)));
+        struct iovec iov = { &n, sizeof(n) };
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+
+        int flags = MSG_WAITALL;
+#ifdef MSG_CMSG_CLOEXEC
+        flags |= MSG_CMSG_CLOEXEC;
+#endif
+        ssize_t r;
+        do
+            r = recvmsg(sock, &msg, flags);
+        while (r < 0 && errno == EINTR);
+        if (r != (ssize_t)sizeof(n))
+            return false;
+
+        size_t got = 0;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const unsigned char *data = CMSG_DATA(c);
+            for (size_t i = 0; i < count; ++i)
+            {
+                int fd;
+                std::memcpy(&fd, data + i * sizeof(int), sizeof(int));
+                fds.push_back(fd);
+            }
+            got += count;
+        }
+        if ((msg.msg_flags & MSG_CTRUNC) || got != n)
+            return false;
+    }
+    return fds.size() == want;
+}
+
+// Clients being closed are left to the old process.
+static void collectClients(Server &server, std::vector<Client*> &clients)
+{
+    std::vector<Client*> all;
+    const std::vector<EventLoop*> &loops = server.loops();
+    for (size_t i = 0; i < loops.size(); ++i)
+        loops[i]->collectClients(all);
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+        if (!all[i]->isClosing())
+            clients.push_back(all[i]);
+    }
+}
+
+static void encodeClient(Encoder &enc, const Client &c)
+{
+    enc.u64(c.getId());
+    enc.u32((unsigned int)c.getLoop()->getId());
+    enc.str(c.getNickname());
+    enc.str(c.getUsername());
+    enc.u8((c.isAuthenticated() ? FLAG_AUTHENTICATED : 0)
+           | (c.hasPassOk() ? FLAG_PASS_OK : 0)
+           | (c.isRegistered() ? FLAG_REGISTERED : 0)
+           | (c.isOper() ? FLAG_OPER : 0)
+           | (c.isParked() ? FLAG_PARKED : 0));
+    enc.str(c.getClass()->name);
+    enc.u64(c.floodClock());
+    enc.u64(c.lastActive());
+    enc.u64(c.pingSentAt());
+
+    Slice input = const_cast<Client&>(c).getInput().pending();
+    enc.u32((unsigned int)input.len);
+    enc.bytes(input.data, input.len);
+    std::string output;
+    c.pendingOutput(output);
+    enc.str(output);
+}
+
+size_t Handoff::encode(Server &server, char *out)
+{
+    Encoder enc(out);
+    std::vector<Client*> clients;
+    collectClients(server, clients);
+    std::map<const Client*, unsigned int> index;
+    for (size_t i = 0; i < clients.size(); ++i)
+        index[clients[i]] = (unsigned int)i;
+
+    const std::vector<EventLoop*> &loops = server.loops();
+    unsigned int listeners = 0;
+    for (size_t i = 0; i < loops.size(); ++i)
+        listeners += loops[i]->listenFd() >= 0;
+
+    enc.bytes(MAGIC, MAGIC_LEN);
+    enc.u64(server.lastClientId());
+    enc.u64(server.capture().isOpen() ? server.capture().startNs() : 0);
+    enc.u64(server.capture().salt());
+    enc.u32(listeners);
+    enc.u32((unsigned int)clients.size());
+    for (size_t i = 0; i < clients.size(); ++i)
+        encodeClient(enc, *clients[i]);
+
+    NameIndex<Channel> &channels = server.getChannels();
+    enc.u32((unsigned int)channels.size());
+    for (size_t i = 0; i < channels.capacity(); ++i)
+    {
+        const Channel *ch = channels.slot(i);
+        if (!ch)
+            continue;
+        enc.str(ch->getName());
+        enc.str(ch->getTopic());
+        enc.str(ch->getKey());
+        enc.u32((unsigned int)ch->getLimit());
+        enc.u8((ch->isInviteOnly() ? CHANNEL_INVITE_ONLY : 0)
+               | (ch->isTopicRestricted() ? CHANNEL_TOPIC_RESTRICTED : 0));
+
+        // Entries of clients that are being closed are dropped with them.
+        const Membership *m = ch->members();
+        unsigned int kept = 0;
+        for (size_t j = 0; j < ch->entryCount(); ++j)
+            kept += index.count(m[j].client);
+        enc.u32(kept);
+        for (size_t j = 0; j < ch->entryCount(); ++j)
+        {
+            std::map<const Client*, unsigned int>::const_iterator it = index.find(m[j].client);
+            if (it == index.end())
+                continue;
+            enc.u32(it->second);
+            enc.u32(m[j].modes);
+        }
+        const std::vector<std::string> &saved = ch->savedOperators();
+        enc.u32((unsigned int)saved.size());
+        for (size_t j = 0; j < saved.size(); ++j)
+            enc.str(saved[j]);
+    }
+    return enc.len;
+}
+
+Handoff::Handoff(int fd)
+: _fd(fd), _startedMs(EventLoop::monotonicMs()), _listeners(0), _taken(0)
+{}
+
+Handoff::~Handoff()
+{
+    for (size_t i = _taken; i < _fds.size(); ++i)
+        close(_fds[i]);
+    if (_fd >= 0)
+        close(_fd);
+}
+
+bool Handoff::send(Server &server, char *const argv[])
+{
+    unsigned long started = EventLoop::monotonicMs();
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        std::cerr << "[Server] Upgrade: socketpair: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    struct timeval tv = { 30, 0 };
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char env[32];
+    std::snprintf(env, sizeof(env), "%d", sv[1]);
+
+    // Every loop thread has been joined, so the child may allocate.
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        std::cerr << "[Server] Upgrade: fork: " << std::strerror(errno) << std::endl;
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if (pid == 0)
+    {
+        // The sockets must arrive only through the handoff, or stray
+        // copies would keep them open after the new process closes them.
+        server.closeInChild();
+        setenv("IRCSERV_UPGRADE_FD", env, 1);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(sv[1]);
+
+    int sock = sv[0];
+    std::vector<Client*> clients;
+    collectClients(server, clients);
+    std::vector<int> fds;
+    const std::vector<EventLoop*> &loops = server.loops();
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        if (loops[i]->listenFd() >= 0)
+            fds.push_back(loops[i]->listenFd());
+    }
+    for (size_t i = 0; i < clients.size(); ++i)
+        fds.push_back(clients[i]->getFd());
+
+    std::string state(encode(server, 0), '\0');
+    encode(server, &state[0]);
+    unsigned long length = state.size();
+
+    char ack = 0;
+    bool ok = recvAll(sock, &ack, 1) && ack == 'R'
+           && sendAll(sock, reinterpret_cast<const char*>(&length), sizeof(length))
+           && sendAll(sock, state.data(), state.size())
+           && sendFds(sock, fds)
+           && recvAll(sock, &ack, 1) && ack == 'D';
+    close(sock);
+    if (!ok)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, 0, 0);
+        std::cerr << "[Server] Upgrade failed, carrying on" << std::endl;
+        return false;
+    }
+    std::cout << "[Server] Handed off " << clients.size() << " clients and "
+              << server.getChannels().size() << " channels to pid " << pid << " in "
+              << EventLoop::monotonicMs() - started << " ms (state " << state.size()
+              << " bytes)" << std::endl;
+    return true;
+}
+
+void Handoff::receive()
+{
+    unsigned long length = 0;
+    if (!sendAll(_fd, "R", 1)
+        || !recvAll(_fd, reinterpret_cast<char*>(&length), sizeof(length)))
+        throw std::runtime_error("upgrade: lost the old process");
+    _state.resize(length);
+    if (length < HEADER_LEN || !recvAll(_fd, &_state[0], length)
+        || _state.compare(0, MAGIC_LEN, MAGIC) != 0)
+        throw std::runtime_error("upgrade: bad state");
+
+    Decoder dec(_state.data() + MAGIC_LEN + 3 * 8, _state.data() + _state.size());
+    _listeners = dec.u32();
+    size_t clients = dec.u32();
+    if (!recvFds(_fd, _fds, _listeners + clients))
+        throw std::runtime_error("upgrade: failed to receive sockets");
+}
+
+unsigned long Handoff::captureStartNs() const
+{
+    Decoder dec(_state.data() + MAGIC_LEN + 8, _state.data() + _state.size());
+    return dec.u64();
+}
+
+unsigned long Handoff::captureSalt() const
+{
+    Decoder dec(_state.data() + MAGIC_LEN + 2 * 8, _state.data() + _state.size());
+    return dec.u64();
+}
+
+int Handoff::takeListener(size_t i)
+{
+    if (i + 1 > _taken)
+        _taken = i + 1;
+    return _fds[i];
+}
+
+size_t Handoff::restore(Server &server)
+{
+    // Listeners that were not taken are closed now, before _taken moves
+    // past them.
+    for (size_t i = _taken; i < _listeners; ++i)
+        close(_fds[i]);
+    _taken = _listeners;
+
+    Decoder dec(_state.data() + MAGIC_LEN, _state.data() + _state.size());
+    unsigned long lastId = dec.u64();
+    dec.u64();
+    dec.u64();
+    dec.u32();
+    size_t count = dec.u32();
+
+    const std::vector<EventLoop*> &loops = server.loops();
+    const std::vector<ConnClass> &classes = server.getConfig().getClasses();
+    std::vector<Client*> clients;
+    for (size_t i = 0; i < count && dec.ok; ++i)
+    {
+        unsigned long id = dec.u64();
+        EventLoop *loop = loops[dec.u32() % loops.size()];
+        std::string nick = dec.str();
+        std::string user = dec.str();
+        unsigned int flags = dec.u8();
+        std::string className = dec.str();
+        unsigned long floodClock = dec.u64();
+        unsigned long lastActive = dec.u64();
+        unsigned long pingSentAt = dec.u64();
+        std::string input = dec.str();
+        std::string output = dec.str();
+        if (!dec.ok)
+            break;
+
+        Client *c = new Client(_fds[_taken++], loop, id);
+        const ConnClass *cls = &classes[0];
+        for (size_t k = 1; k < classes.size(); ++k)
+        {
+            if (classes[k].name == className)
+                cls = &classes[k];
+        }
+        c->setClass(cls);
+        if (!nick.empty())
+            server.renameClient(*c, nick);
+        c->setUsername(user);
+        if (flags & FLAG_AUTHENTICATED)
+            c->authenticate();
+        c->setPassOk((flags & FLAG_PASS_OK) != 0);
+        if (flags & FLAG_REGISTERED)
+            c->markRegistered();
+        c->setOper((flags & FLAG_OPER) != 0);
+        c->setParked((flags & FLAG_PARKED) != 0);
+        c->setFloodClock(floodClock);
+        c->touch(lastActive);
+        c->setPingSentAt(pingSentAt);
+
+        InputBuffer &in = c->getInput();
+        size_t n = input.size() < in.writable() ? input.size() : in.writable();
+        std::memcpy(in.writePtr(), input.data(), n);
+        in.commit(n);
+
+        loop->adoptClient(c);
+        if (!output.empty())
+            c->queueSend(output);
+        clients.push_back(c);
+    }
+
+    size_t channels = dec.u32();
+    for (size_t i = 0; i < channels && dec.ok; ++i)
+    {
+        std::string name = dec.str();
+        std::string topic = dec.str();
+        std::string key = dec.str();
+        size_t limit = dec.u32();
+        unsigned int flags = dec.u8();
+        if (!dec.ok || name.empty())
+            break;
+
+        Channel *ch = server.getChannel(name);
+        ch->setTopic(topic);
+        ch->setKey(key);
+        ch->setLimit(limit);
+        ch->setInviteOnly((flags & CHANNEL_INVITE_ONLY) != 0);
+        ch->setTopicRestricted((flags & CHANNEL_TOPIC_RESTRICTED) != 0);
+
+        unsigned int entries = dec.u32();
+        for (unsigned int j = 0; j < entries && dec.ok; ++j)
+        {
+            unsigned int idx = dec.u32();
+            unsigned int modes = dec.u32();
+            if (dec.ok && idx < clients.size())
+                ch->restoreEntry(clients[idx], modes);
+        }
+        unsigned int saved = dec.u32();
+        for (unsigned int j = 0; j < saved && dec.ok; ++j)
+            ch->addSavedOperator(dec.str());
+    }
+    if (!dec.ok)
+        std::cerr << "[Server] Upgrade: state is truncated, some of it was lost" << std::endl;
+    server.resumeClientIds(lastId);
+    return clients.size();
+}
+
+void Handoff::confirm()
+{
+    if (!sendAll(_fd, "D", 1))
+        throw std::runtime_error("upgrade: lost the old process");
+    std::cout << "[Server] Took over " << (_taken - _listeners) << " clients in "
+              << EventLoop::monotonicMs() - _startedMs << " ms" << std::endl;
+}
@@ -0,0 +1,63 @@
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+class Server;
+
+// Hot upgrade. The running server forks and execs its binary again with
+// one end of a socketpair in IRCSERV_UPGRADE_FD, then passes over
+//
+//   1. the serialized state: "IRCHOFF1", u64 last client id, u64
+//      capture start and salt, u32 listener count, u32 client count,
+//      the clients (id, loop, nick, user, flags, class, flood clock,
+//      timestamps, unread input, unsent output) and the channels
+//      (settings, member entries by client index, saved operators);
+//   2. the listening sockets and then every client socket, in batches
+//      of SCM_RIGHTS messages.
+//
+// The new process answers 'R' once it is ready to receive and 'D' once
+// it owns everything; only then does the old one let go. Any failure
+// before that kills the new process and the old one carries on.
+class Handoff
+{
+    private:
+        int _fd;
+        unsigned long _startedMs;
+        std::string _state;
+        std::vector<int> _fds;
+        size_t _listeners;
+        size_t _taken;
+
+        Handoff(const Handoff &);
+        Handoff &operator=(const Handoff &);
+
+        static size_t encode(Server &server, char *out);
+
+    public:
+        enum { FDS_PER_MESSAGE = 250 };
+
+        explicit Handoff(int fd);
+        ~Handoff();
+
+        // Old side: runs with every loop stopped. Returns true once the
+        // new process has confirmed; the caller then exits without
+        // touching the sockets.
+        static bool send(Server &server, char *const argv[]);
+
+        // New side, in order: receive() reads the state and the sockets,
+        // the caller takes the listeners and builds its loops, restore()
+        // recreates clients and channels and confirm() releases the old
+        // process.
+        void receive();
+        unsigned long captureStartNs() const;
+        unsigned long captureSalt() const;
+        size_t listenerCount() const { return _listeners; }
+        int takeListener(size_t i);
+        size_t restore(Server &server);
+        void confirm();
+};
+
+#endif
@@ -0,0 +1,62 @@
+#include "InputBuffer.hpp"
+#include "Scan.hpp"
+#include <cstring>
+
+InputBuffer::InputBuffer()
+: _head(0), _tail(0)
+{}
+
+char *InputBuffer::writePtr()
+{
+    return _data + _tail;
+}
+
+size_t InputBuffer::writable()
+{
+    if (_tail == CAPACITY && _head > 0)
+    {
+        std::memmove(_data, _data + _head, _tail - _head);
+        _tail -= _head;
+        _head = 0;
+    }
+    return CAPACITY - _tail;
+}
+
+void InputBuffer::commit(size_t n)
+{
+    _tail += n;
+}
+
+InputBuffer::LineStatus InputBuffer::nextLine(Slice &line)
+{
+    size_t avail = _tail - _head;
+    size_t scan = avail < (size_t)MAX_LINE ? avail : (size_t)MAX_LINE;
+    const char *start = _data + _head;
+    const char *nl = scanByte(start, start + scan, '\n');
+
+    if (nl == start + scan)
+    {
+        if (avail >= (size_t)MAX_LINE)
+            return LINE_TOO_LONG;
+        if (avail == 0)
+            _head = _tail = 0;
+        return LINE_PARTIAL;
+    }
+
+    size_t len = nl - start;
+    _head += len + 1;
+    if (len > 0 && start[len - 1] == '\r')
+        --len;
+    line = Slice(start, len);
+    return LINE_READY;
+}
+
+size_t InputBuffer::size() const
+{
+    return _tail - _head;
+}
+
+Slice InputBuffer::pending() const
+{
+    return Slice(_data + _head, _tail - _head);
+}
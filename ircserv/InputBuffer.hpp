@@ -0,0 +1,44 @@
+#ifndef INPUTBUFFER_HPP
+#define INPUTBUFFER_HPP
+
+#include <cstddef>
+#include "Slice.hpp"
+
+// Fixed-capacity receive buffer. Complete lines are returned as slices
+// into the buffer; only the unconsumed tail is ever moved. That tail is
+// at most one partial line unless flood control has parked the client.
+class InputBuffer
+{
+    public:
+        enum
+        {
+            CAPACITY = 8192,
+            MAX_LINE = 512
+        };
+
+        enum LineStatus
+        {
+            LINE_READY,
+            LINE_PARTIAL,
+            LINE_TOO_LONG
+        };
+
+    private:
+        char _data[CAPACITY];
+        size_t _head;
+        size_t _tail;
+
+    public:
+        InputBuffer();
+
+        char *writePtr();
+        size_t writable();
+        void commit(size_t n);
+
+        LineStatus nextLine(Slice &line);
+        size_t size() const;
+        // Bytes received but not yet returned as lines.
+        Slice pending() const;
+};
+
+#endif
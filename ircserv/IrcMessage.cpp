@@ -0,0 +1,60 @@
+#include "IrcMessage.hpp"
+#include "Scan.hpp"
+
+static const Slice s_empty;
+
+IrcMessage::IrcMessage()
+: paramCount(0), hasTrailing(false)
+{}
+
+const Slice &IrcMessage::param(size_t i) const
+{
+    return i < paramCount ? params[i] : s_empty;
+}
+
+std::string IrcMessage::arg(size_t i) const
+{
+    return param(i).str();
+}
+
+bool parseMessage(const Slice &line, IrcMessage &msg)
+{
+    const char *p = line.data;
+    const char *end = line.data + line.len;
+
+    msg.prefix = Slice();
+    msg.command = Slice();
+    msg.paramCount = 0;
+    msg.hasTrailing = false;
+
+    p = skipByte(p, end, ' ');
+    if (p < end && *p == ':')
+    {
+        const char *sp = scanByte(p + 1, end, ' ');
+        msg.prefix = Slice(p + 1, sp - p - 1);
+        p = skipByte(sp, end, ' ');
+    }
+
+    const char *sp = scanByte(p, end, ' ');
+    msg.command = Slice(p, sp - p);
+    p = sp;
+
+    while (msg.paramCount < IrcMessage::MAX_PARAMS)
+    {
+        p = skipByte(p, end, ' ');
+        if (p >= end)
+            break;
+        if (*p == ':' || msg.paramCount == IrcMessage::MAX_PARAMS - 1)
+        {
+            if (*p == ':')
+                ++p;
+            msg.params[msg.paramCount++] = Slice(p, end - p);
+            msg.hasTrailing = true;
+            break;
+        }
+        sp = scanByte(p, end, ' ');
+        msg.params[msg.paramCount++] = Slice(p, sp - p);
+        p = sp;
+    }
+    return !msg.command.empty();
+}
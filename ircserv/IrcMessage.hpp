@@ -0,0 +1,27 @@
+#ifndef IRCMESSAGE_HPP
+#define IRCMESSAGE_HPP
+
+#include <string>
+#include "Slice.hpp"
+
+// One parsed protocol line. Every field is a slice into the line it was
+// parsed from, so the message is only valid while that line is.
+struct IrcMessage
+{
+    enum { MAX_PARAMS = 15 };
+
+    Slice prefix;
+    Slice command;
+    Slice params[MAX_PARAMS];
+    size_t paramCount;
+    bool hasTrailing;
+
+    IrcMessage();
+
+    const Slice &param(size_t i) const;
+    std::string arg(size_t i) const;
+};
+
+bool parseMessage(const Slice &line, IrcMessage &msg);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef MAILBOX_HPP
+#define MAILBOX_HPP
+
+#include "SharedBuffer.hpp"
+#include "Pool.hpp"
+
+// A line to be queued on a client owned by another event loop. The
+// owning loop re-checks clientId against its fd table before delivering,
+// so a delivery to a client that disconnected in the meantime is dropped.
+struct Delivery
+{
+    Delivery *next;
+    int fd;
+    unsigned long clientId;
+    int priority;
+    SharedBuffer data;
+
+    static Pool &pool()
+    {
+        static Pool pool("delivery", sizeof(Delivery), 1024);
+        return pool;
+    }
+    static void *operator new(size_t) { return pool().allocate(); }
+    static void operator delete(void *p) { pool().release(p); }
+};
+
+// Lock-free multi-producer, single-consumer queue (Vyukov's intrusive
+// design). Any thread may push(); only the owning loop may pop().
+class Mailbox
+{
+    private:
+        Delivery *_head;
+        Delivery *_tail;
+        Delivery _stub;
+
+        Mailbox(const Mailbox &);
+        Mailbox &operator=(const Mailbox &);
+
+    public:
+        Mailbox()
+        : _head(&_stub), _tail(&_stub)
+        {
+            _stub.next = 0;
+        }
+
+        ~Mailbox()
+        {
+            while (Delivery *d = pop())
+                delete d;
+        }
+
+        void push(Delivery *d)
+        {
+            __atomic_store_n(&d->next, (Delivery*)0, __ATOMIC_RELAXED);
+            Delivery *prev = __atomic_exchange_n(&_head, d, __ATOMIC_ACQ_REL);
+            __atomic_store_n(&prev->next, d, __ATOMIC_RELEASE);
+        }
+
+        // Returns 0 when empty, or while a producer is between its
+        // exchange and its link; the next wakeup picks that entry up.
+        Delivery *pop()
+        {
+            Delivery *tail = _tail;
+            Delivery *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+            if (tail == &_stub)
+            {
+                if (!next)
+                    return 0;
+                _tail = next;
+                tail = next;
+                next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+            }
+            if (next)
+            {
+                _tail = next;
+                return tail;
+            }
+            if (tail != __atomic_load_n(&_head, __ATOMIC_ACQUIRE))
+                return 0;
+            push(&_stub);
+            next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+            if (next)
+            {
+                _tail = next;
+                return tail;
+            }
+            return 0;
+        }
+};
+
+#endif
@@ -0,0 +1,182 @@
+#include "MemberTable.hpp"
+#include <algorithm>
+
+static const size_t NPOS = (size_t)-1;
+
+MemberTable::MemberTable()
+: _memberCount(0), _opCount(0)
+{}
+
+size_t MemberTable::hash(const Client *c)
+{
+    size_t h = (reinterpret_cast<size_t>(c) >> 4) * 0x9E3779B97F4A7C15UL;
+    return h ^ (h >> 29);
+}
+
+size_t MemberTable::slotOf(const Client *c) const
+{
+    size_t i = hash(c) & mask();
+    while (_index[i] && _entries[_index[i] - 1].client != c)
+        i = (i + 1) & mask();
+    return i;
+}
+
+size_t MemberTable::find(const Client *c) const
+{
+    if (_index.empty())
+    {
+        for (size_t i = 0; i < _entries.size(); ++i)
+        {
+            if (_entries[i].client == c)
+                return i;
+        }
+        return NPOS;
+    }
+    size_t slot = slotOf(c);
+    return _index[slot] ? _index[slot] - 1 : NPOS;
+}
+
+void MemberTable::rebuildIndex(size_t slots)
+{
+    _index.assign(slots, 0);
+    for (size_t pos = 0; pos < _entries.size(); ++pos)
+        _index[slotOf(_entries[pos].client)] = pos + 1;
+}
+
+void MemberTable::append(Client *c, unsigned int modes)
+{
+    Membership m;
+    m.client = c;
+    m.modes = modes;
+    _entries.push_back(m);
+
+    if (_index.empty())
+    {
+        if (_entries.size() > LINEAR_MAX)
+            rebuildIndex(4 * LINEAR_MAX);
+    }
+    else if (_entries.size() * 2 > _index.size())
+        rebuildIndex(_index.size() * 2);
+    else
+        _index[slotOf(c)] = _entries.size();
+}
+
+void MemberTable::swapEntries(size_t a, size_t b)
+{
+    if (a == b)
+        return;
+    if (!_index.empty())
+    {
+        size_t slotA = slotOf(_entries[a].client);
+        size_t slotB = slotOf(_entries[b].client);
+        _index[slotA] = b + 1;
+        _index[slotB] = a + 1;
+    }
+    std::swap(_entries[a], _entries[b]);
+}
+
+void MemberTable::removeAt(size_t pos)
+{
+    size_t last = _entries.size() - 1;
+    swapEntries(pos, last);
+    if (!_index.empty())
+    {
+        // Backward-shift deletion, as in NameIndex.
+        size_t hole = slotOf(_entries[last].client);
+        size_t j = (hole + 1) & mask();
+        while (_index[j])
+        {
+            size_t home = hash(_entries[_index[j] - 1].client) & mask();
+            if (((j - home) & mask()) >= ((j - hole) & mask()))
+            {
+                _index[hole] = _index[j];
+                hole = j;
+            }
+            j = (j + 1) & mask();
+        }
+        _index[hole] = 0;
+    }
+    _entries.pop_back();
+}
+
+unsigned int MemberTable::modes(const Client *c) const
+{
+    size_t pos = find(c);
+    return pos == NPOS ? 0 : _entries[pos].modes;
+}
+
+bool MemberTable::join(Client *c)
+{
+    size_t pos = find(c);
+    if (pos == NPOS)
+    {
+        append(c, MEMBER);
+        pos = _entries.size() - 1;
+    }
+    else if (_entries[pos].modes & MEMBER)
+        return false;
+    else
+        _entries[pos].modes = (_entries[pos].modes & ~INVITED) | MEMBER;
+
+    swapEntries(pos, _memberCount);
+    ++_memberCount;
+    return true;
+}
+
+bool MemberTable::part(Client *c)
+{
+    size_t pos = find(c);
+    if (pos == NPOS || !(_entries[pos].modes & MEMBER))
+        return false;
+
+    unsigned int &modes = _entries[pos].modes;
+    if (modes & OP)
+        --_opCount;
+    modes &= ~(MEMBER | OP | VOICE);
+    bool drop = modes == 0;
+
+    --_memberCount;
+    swapEntries(pos, _memberCount);
+    if (drop)
+        removeAt(_memberCount);
+    return true;
+}
+
+bool MemberTable::set(Client *c, unsigned int bits)
+{
+    bits &= ~MEMBER;
+    size_t pos = find(c);
+    if (pos == NPOS)
+    {
+        if (!bits)
+            return false;
+        append(c, bits);
+        if (bits & OP)
+            ++_opCount;
+        return true;
+    }
+
+    unsigned int &modes = _entries[pos].modes;
+    if ((modes & bits) == bits)
+        return false;
+    if ((bits & OP) && !(modes & OP))
+        ++_opCount;
+    modes |= bits;
+    return true;
+}
+
+bool MemberTable::clear(Client *c, unsigned int bits)
+{
+    bits &= ~MEMBER;
+    size_t pos = find(c);
+    if (pos == NPOS || !(_entries[pos].modes & bits))
+        return false;
+
+    unsigned int &modes = _entries[pos].modes;
+    if ((bits & OP) && (modes & OP))
+        --_opCount;
+    modes &= ~bits;
+    if (modes == 0)
+        removeAt(pos);
+    return true;
+}
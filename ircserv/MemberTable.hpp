@@ -0,0 +1,75 @@
+#ifndef MEMBERTABLE_HPP
+#define MEMBERTABLE_HPP
+
+#include <cstddef>
+#include <vector>
+
+class Client;
+
+struct Membership
+{
+    Client *client;
+    unsigned int modes;
+};
+
+// A channel's clients and their per-channel mode bits in one flat array.
+// Members occupy the front of the array, so a broadcast is a linear walk
+// over [0, memberCount()); entries that only carry an invitation sit
+// behind them. Lookups scan the array while it is small and go through an
+// open-addressing index of array positions once it grows. Removal swaps
+// the last entry into the gap, so member order is not stable.
+class MemberTable
+{
+    private:
+        std::vector<Membership> _entries;
+        std::vector<unsigned int> _index;
+        size_t _memberCount;
+        size_t _opCount;
+
+        MemberTable(const MemberTable &);
+        MemberTable &operator=(const MemberTable &);
+
+        size_t mask() const { return _index.size() - 1; }
+        static size_t hash(const Client *c);
+
+        size_t find(const Client *c) const;
+        size_t slotOf(const Client *c) const;
+        void append(Client *c, unsigned int modes);
+        void swapEntries(size_t a, size_t b);
+        void removeAt(size_t pos);
+        void rebuildIndex(size_t slots);
+
+    public:
+        enum
+        {
+            MEMBER = 1,
+            OP = 2,
+            VOICE = 4,
+            INVITED = 8
+        };
+
+        // Entry counts up to which lookups scan instead of hashing.
+        enum { LINEAR_MAX = 16 };
+
+        MemberTable();
+
+        size_t memberCount() const { return _memberCount; }
+        size_t opCount() const { return _opCount; }
+        const Membership *members() const { return _entries.empty() ? 0 : &_entries[0]; }
+        // Members followed by invitation-only entries.
+        size_t entryCount() const { return _entries.size(); }
+
+        unsigned int modes(const Client *c) const;
+
+        // join() sets MEMBER and drops a pending invitation; part() clears
+        // every member bit. Both return false if nothing changed.
+        bool join(Client *c);
+        bool part(Client *c);
+
+        // Sets or clears bits other than MEMBER; returns whether anything
+        // changed.
+        bool set(Client *c, unsigned int bits);
+        bool clear(Client *c, unsigned int bits);
+};
+
+#endif
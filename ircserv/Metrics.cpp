@@ -0,0 +1,151 @@
+#include "Metrics.hpp"
+#include "Commands.hpp"
+#include <sstream>
+#include <time.h>
+
+static __thread Metrics *s_current = 0;
+
+void Histogram::observe(unsigned long value)
+{
+    int b = value ? (int)(sizeof(unsigned long) * 8) - __builtin_clzl(value) : 0;
+    if (b >= BUCKETS)
+        b = BUCKETS - 1;
+    Metrics::add(buckets[b]);
+    Metrics::add(count);
+    Metrics::add(sum, value);
+}
+
+void Histogram::addTo(Histogram &total) const
+{
+    for (int i = 0; i < BUCKETS; ++i)
+        total.buckets[i] += Metrics::read(buckets[i]);
+    total.count += Metrics::read(count);
+    total.sum += Metrics::read(sum);
+}
+
+unsigned long Histogram::bound(int bucket)
+{
+    return bucket == 0 ? 0 : (1UL << bucket) - 1;
+}
+
+unsigned long Histogram::quantile(double q) const
+{
+    if (!count)
+        return 0;
+    unsigned long want = (unsigned long)(q * count);
+    if (want >= count)
+        want = count - 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+    {
+        seen += buckets[i];
+        if (seen > want)
+            return bound(i);
+    }
+    return bound(BUCKETS - 1);
+}
+
+Metrics::Metrics()
+: connectionsAccepted(0), connectionsClosed(0), bytesIn(0), bytesOut(0),
+  sendqBytes(0), sendqDropped(0)
+{
+    for (int i = 0; i < MAX_COMMANDS; ++i)
+    {
+        lines[i] = 0;
+        latencyNs[i] = Histogram();
+    }
+    fanout = Histogram();
+    sendqDepth = Histogram();
+}
+
+void Metrics::addTo(Metrics &total) const
+{
+    total.connectionsAccepted += read(connectionsAccepted);
+    total.connectionsClosed += read(connectionsClosed);
+    total.bytesIn += read(bytesIn);
+    total.bytesOut += read(bytesOut);
+    total.sendqBytes += read(sendqBytes);
+    total.sendqDropped += read(sendqDropped);
+    for (int i = 0; i < MAX_COMMANDS; ++i)
+    {
+        total.lines[i] += read(lines[i]);
+        latencyNs[i].addTo(total.latencyNs[i]);
+    }
+    fanout.addTo(total.fanout);
+    sendqDepth.addTo(total.sendqDepth);
+}
+
+Metrics *Metrics::current()
+{
+    return s_current;
+}
+
+void Metrics::setCurrent(Metrics *m)
+{
+    s_current = m;
+}
+
+unsigned long Metrics::monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void renderHistogram(std::ostringstream &os, const char *name,
+                            const std::string &labels, const Histogram &h)
+{
+    std::string sep = labels.empty() ? "" : ",";
+    unsigned long cumulative = 0;
+    for (int i = 0; i < Histogram::BUCKETS - 1; ++i)
+    {
+        cumulative += h.buckets[i];
+        os << name << "_bucket{" << labels << sep << "le=\"" << Histogram::bound(i) << "\"} "
+           << cumulative << "\n";
+    }
+    os << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << h.count << "\n";
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    os << name << "_sum" << braces << " " << h.sum << "\n";
+    os << name << "_count" << braces << " " << h.count << "\n";
+}
+
+static std::string commandName(size_t i)
+{
+    return i < Commands::count() ? Commands::at(i).name : "unknown";
+}
+
+// Called on an aggregate built by addTo(), so fields are read directly.
+void Metrics::renderPrometheus(std::string &out) const
+{
+    std::ostringstream os;
+    os << "# TYPE ircserv_connections_accepted_total counter\n"
+       << "ircserv_connections_accepted_total " << connectionsAccepted << "\n"
+       << "# TYPE ircserv_connections_closed_total counter\n"
+       << "ircserv_connections_closed_total " << connectionsClosed << "\n"
+       << "# TYPE ircserv_connections gauge\n"
+       << "ircserv_connections " << connectionsAccepted - connectionsClosed << "\n"
+       << "# TYPE ircserv_received_bytes_total counter\n"
+       << "ircserv_received_bytes_total " << bytesIn << "\n"
+       << "# TYPE ircserv_sent_bytes_total counter\n"
+       << "ircserv_sent_bytes_total " << bytesOut << "\n"
+       << "# TYPE ircserv_sendq_bytes gauge\n"
+       << "ircserv_sendq_bytes " << sendqBytes << "\n"
+       << "# TYPE ircserv_sendq_dropped_bytes_total counter\n"
+       << "ircserv_sendq_dropped_bytes_total " << sendqDropped << "\n";
+
+    size_t n = Commands::count() + 1;
+    os << "# TYPE ircserv_lines_total counter\n";
+    for (size_t i = 0; i < n; ++i)
+        os << "ircserv_lines_total{command=\"" << commandName(i) << "\"} " << lines[i] << "\n";
+
+    os << "# TYPE ircserv_command_duration_nanoseconds histogram\n";
+    for (size_t i = 0; i < n; ++i)
+        renderHistogram(os, "ircserv_command_duration_nanoseconds",
+                        "command=\"" + commandName(i) + "\"", latencyNs[i]);
+
+    os << "# TYPE ircserv_fanout_recipients histogram\n";
+    renderHistogram(os, "ircserv_fanout_recipients", "", fanout);
+    os << "# TYPE ircserv_sendq_depth_bytes histogram\n";
+    renderHistogram(os, "ircserv_sendq_depth_bytes", "", sendqDepth);
+    out += os.str();
+}
@@ -0,0 +1,69 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <cstddef>
+#include <string>
+
+// Fixed power-of-two buckets: bucket i counts values below 2^i (bucket 0
+// is exactly zero); the last bucket is unbounded.
+struct Histogram
+{
+    enum { BUCKETS = 32 };
+
+    unsigned long buckets[BUCKETS];
+    unsigned long count;
+    unsigned long sum;
+
+    void observe(unsigned long value);
+    void addTo(Histogram &total) const;
+
+    // Upper bound of the bucket holding quantile q (0..1).
+    unsigned long quantile(double q) const;
+    static unsigned long bound(int bucket);
+};
+
+// Counters for one event loop. Only the owning thread writes them, with
+// plain relaxed stores, so the hot path takes no lock and does no atomic
+// read-modify-write; readers sum all loops with addTo().
+struct Metrics
+{
+    enum { MAX_COMMANDS = 32 };
+
+    unsigned long connectionsAccepted;
+    unsigned long connectionsClosed;
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+    unsigned long sendqBytes;
+    unsigned long sendqDropped;
+    unsigned long lines[MAX_COMMANDS];
+    Histogram latencyNs[MAX_COMMANDS];
+    Histogram fanout;
+    Histogram sendqDepth;
+
+    Metrics();
+
+    void addTo(Metrics &total) const;
+
+    static void add(unsigned long &counter, unsigned long n = 1)
+    {
+        __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+    static void sub(unsigned long &counter, unsigned long n)
+    {
+        __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) - n, __ATOMIC_RELAXED);
+    }
+    static unsigned long read(const unsigned long &counter)
+    {
+        return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+    }
+
+    // The metrics of the loop running on this thread, or 0.
+    static Metrics *current();
+    static void setCurrent(Metrics *m);
+    static unsigned long monotonicNs();
+
+    // Prometheus text exposition format.
+    void renderPrometheus(std::string &out) const;
+};
+
+#endif
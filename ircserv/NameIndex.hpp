@@ -0,0 +1,105 @@
+#ifndef NAMEINDEX_HPP
+#define NAMEINDEX_HPP
+
+#include <string>
+#include <vector>
+#include "CaseMap.hpp"
+
+// Open-addressing hash index keyed by the casefolded name of T, which
+// must provide `const FoldedName &foldedName() const`. The index only
+// stores pointers; the key lives in the object, so renaming an entry
+// means erase(), change the name, insert().
+template <typename T>
+class NameIndex
+{
+    private:
+        std::vector<T*> _table;
+        size_t _size;
+
+        size_t mask() const { return _table.size() - 1; }
+
+        void grow()
+        {
+            std::vector<T*> old;
+            old.swap(_table);
+            _table.assign(old.size() * 2, 0);
+            _size = 0;
+            for (size_t i = 0; i < old.size(); ++i)
+            {
+                if (old[i])
+                    insert(old[i]);
+            }
+        }
+
+    public:
+        NameIndex() : _table(16, (T*)0), _size(0) {}
+
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+
+        // Raw slot access for iteration; empty slots are null.
+        size_t capacity() const { return _table.size(); }
+        T *slot(size_t i) const { return _table[i]; }
+
+        T *find(const char *name, size_t len) const
+        {
+            size_t i = foldedHash(name, len) & mask();
+            while (_table[i])
+            {
+                if (foldedEquals(_table[i]->foldedName().key(), name, len))
+                    return _table[i];
+                i = (i + 1) & mask();
+            }
+            return 0;
+        }
+
+        T *find(const std::string &name) const
+        {
+            return find(name.data(), name.size());
+        }
+
+        bool insert(T *item)
+        {
+            if ((_size + 1) * 4 > _table.size() * 3)
+                grow();
+            const FoldedName &key = item->foldedName();
+            size_t i = key.hash() & mask();
+            while (_table[i])
+            {
+                if (_table[i] == item || _table[i]->foldedName().key() == key.key())
+                    return _table[i] == item;
+                i = (i + 1) & mask();
+            }
+            _table[i] = item;
+            ++_size;
+            return true;
+        }
+
+        void erase(T *item)
+        {
+            size_t i = item->foldedName().hash() & mask();
+            while (_table[i] && _table[i] != item)
+                i = (i + 1) & mask();
+            if (!_table[i])
+                return;
+
+            // Backward-shift deletion keeps probe chains intact without
+            // tombstones.
+            size_t hole = i;
+            size_t j = (i + 1) & mask();
+            while (_table[j])
+            {
+                size_t home = _table[j]->foldedName().hash() & mask();
+                if (((j - home) & mask()) >= ((j - hole) & mask()))
+                {
+                    _table[hole] = _table[j];
+                    hole = j;
+                }
+                j = (j + 1) & mask();
+            }
+            _table[hole] = 0;
+            --_size;
+        }
+};
+
+#endif
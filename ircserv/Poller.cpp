@@ -0,0 +1,189 @@
+#include "Poller.hpp"
+#include <stdexcept>
+#include <cerrno>
+#include <unistd.h>
+
+Poller::~Poller() {}
+
+int Poller::descriptor() const
+{
+    return -1;
+}
+
+Poller *Poller::create(const std::string &backend)
+{
+#ifdef IRC_HAVE_EPOLL
+    if (backend.empty() || backend == "epoll")
+        return new EpollPoller();
+#endif
+    if (backend.empty() || backend == "poll")
+        return new PollPoller();
+    throw std::runtime_error("unknown poller backend: " + backend);
+}
+
+static short toPollEvents(int interest)
+{
+    short ev = 0;
+    if (interest & Poller::READABLE)
+        ev |= POLLIN;
+    if (interest & Poller::WRITABLE)
+        ev |= POLLOUT;
+    return ev;
+}
+
+PollPoller::PollPoller() {}
+
+PollPoller::~PollPoller() {}
+
+const char *PollPoller::name() const
+{
+    return "poll";
+}
+
+int PollPoller::find(int fd) const
+{
+    if (fd < 0 || (size_t)fd >= _index.size())
+        return -1;
+    return _index[fd];
+}
+
+void PollPoller::add(int fd, int interest, bool)
+{
+    if ((size_t)fd >= _index.size())
+        _index.resize(fd + 1, -1);
+    pollfd p; p.fd = fd; p.events = toPollEvents(interest); p.revents = 0;
+    _index[fd] = (int)_pollfds.size();
+    _pollfds.push_back(p);
+}
+
+void PollPoller::modify(int fd, int interest)
+{
+    int i = find(fd);
+    if (i >= 0)
+        _pollfds[i].events = toPollEvents(interest);
+}
+
+void PollPoller::remove(int fd)
+{
+    int i = find(fd);
+    if (i < 0)
+        return;
+    _pollfds[i] = _pollfds.back();
+    _index[_pollfds[i].fd] = i;
+    _pollfds.pop_back();
+    _index[fd] = -1;
+}
+
+int PollPoller::wait(std::vector<Event> &ready, int timeoutMs)
+{
+    ready.clear();
+    if (_pollfds.empty())
+        return 0;
+
+    int ret = poll(&_pollfds[0], _pollfds.size(), timeoutMs);
+    if (ret <= 0)
+        return 0;
+
+    for (size_t i = 0; i < _pollfds.size() && (int)ready.size() < ret; ++i)
+    {
+        short rev = _pollfds[i].revents;
+        if (!rev)
+            continue;
+        Event e; e.fd = _pollfds[i].fd; e.events = 0;
+        if (rev & POLLIN)
+            e.events |= READABLE;
+        if (rev & POLLOUT)
+            e.events |= WRITABLE;
+        if (rev & (POLLHUP | POLLERR | POLLNVAL))
+            e.events |= HANGUP;
+        ready.push_back(e);
+    }
+    return (int)ready.size();
+}
+
+#ifdef IRC_HAVE_EPOLL
+
+EpollPoller::EpollPoller()
+: _epfd(epoll_create(1024)), _events(256)
+{
+    if (_epfd < 0)
+        throw std::runtime_error("epoll_create failed");
+}
+
+EpollPoller::~EpollPoller()
+{
+    close(_epfd);
+}
+
+const char *EpollPoller::name() const
+{
+    return "epoll";
+}
+
+int EpollPoller::descriptor() const
+{
+    return _epfd;
+}
+
+static void control(int epfd, int op, int fd, int interest, bool edge)
+{
+    epoll_event ev;
+    ev.events = 0;
+    ev.data.u64 = 0;
+    ev.data.fd = fd;
+    if (interest & Poller::READABLE)
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (interest & Poller::WRITABLE)
+        ev.events |= EPOLLOUT;
+    if (edge)
+        ev.events |= EPOLLET;
+    epoll_ctl(epfd, op, fd, &ev);
+}
+
+void EpollPoller::add(int fd, int interest, bool edgeTriggered)
+{
+    if ((size_t)fd >= _edge.size())
+        _edge.resize(fd + 1, 0);
+    _edge[fd] = edgeTriggered;
+    control(_epfd, EPOLL_CTL_ADD, fd, interest, edgeTriggered);
+}
+
+void EpollPoller::modify(int fd, int interest)
+{
+    bool edge = (size_t)fd < _edge.size() && _edge[fd];
+    control(_epfd, EPOLL_CTL_MOD, fd, interest, edge);
+}
+
+void EpollPoller::remove(int fd)
+{
+    epoll_event ev;
+    ev.events = 0;
+    ev.data.u64 = 0;
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int EpollPoller::wait(std::vector<Event> &ready, int timeoutMs)
+{
+    ready.clear();
+    int n = epoll_wait(_epfd, &_events[0], _events.size(), timeoutMs);
+    if (n <= 0)
+        return 0;
+
+    for (int i = 0; i < n; ++i)
+    {
+        unsigned int rev = _events[i].events;
+        Event e; e.fd = _events[i].data.fd; e.events = 0;
+        if (rev & EPOLLIN)
+            e.events |= READABLE;
+        if (rev & EPOLLOUT)
+            e.events |= WRITABLE;
+        if (rev & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+            e.events |= HANGUP;
+        ready.push_back(e);
+    }
+    if ((size_t)n == _events.size())
+        _events.resize(_events.size() * 2);
+    return n;
+}
+
+#endif
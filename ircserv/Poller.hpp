@@ -0,0 +1,84 @@
+#ifndef POLLER_HPP
+#define POLLER_HPP
+
+#include <string>
+#include <vector>
+#include <poll.h>
+
+#if defined(__linux__) && !defined(IRC_NO_EPOLL)
+# define IRC_HAVE_EPOLL 1
+# include <sys/epoll.h>
+#endif
+
+// Readiness backend for Server::run. Fds are registered once and wait()
+// only reports the ones that are ready.
+class Poller
+{
+    public:
+        enum
+        {
+            READABLE = 1,
+            WRITABLE = 2,
+            HANGUP = 4
+        };
+
+        struct Event
+        {
+            int fd;
+            int events;
+        };
+
+        virtual ~Poller();
+
+        virtual const char *name() const = 0;
+        virtual void add(int fd, int interest, bool edgeTriggered) = 0;
+        virtual void modify(int fd, int interest) = 0;
+        virtual void remove(int fd) = 0;
+        virtual int wait(std::vector<Event> &ready, int timeoutMs) = 0;
+        // The descriptor behind the poller, or -1 if it has none.
+        virtual int descriptor() const;
+
+        static Poller *create(const std::string &backend);
+};
+
+class PollPoller : public Poller
+{
+    private:
+        std::vector<pollfd> _pollfds;
+        std::vector<int> _index;
+
+        int find(int fd) const;
+
+    public:
+        PollPoller();
+        ~PollPoller();
+
+        const char *name() const;
+        void add(int fd, int interest, bool edgeTriggered);
+        void modify(int fd, int interest);
+        void remove(int fd);
+        int wait(std::vector<Event> &ready, int timeoutMs);
+};
+
+#ifdef IRC_HAVE_EPOLL
+class EpollPoller : public Poller
+{
+    private:
+        int _epfd;
+        std::vector<unsigned char> _edge;
+        std::vector<epoll_event> _events;
+
+    public:
+        EpollPoller();
+        ~EpollPoller();
+
+        const char *name() const;
+        void add(int fd, int interest, bool edgeTriggered);
+        void modify(int fd, int interest);
+        void remove(int fd);
+        int wait(std::vector<Event> &ready, int timeoutMs);
+        int descriptor() const;
+};
+#endif
+
+#endif
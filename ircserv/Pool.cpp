@@ -0,0 +1,153 @@
+#include "Pool.hpp"
+#include <new>
+
+static Pool *s_pools = 0;
+static int s_poolsLock = 0;
+
+static void spinLock(int *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            ;
+}
+
+static void spinUnlock(int *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+// Rounded up so every object keeps malloc's alignment guarantee.
+static size_t alignedSize(size_t n)
+{
+    const size_t align = 2 * sizeof(void*);
+    if (n < sizeof(void*))
+        n = sizeof(void*);
+    return (n + align - 1) & ~(align - 1);
+}
+
+Pool::Pool(const char *name, size_t objectSize, size_t perSlab)
+: _name(name), _objectSize(alignedSize(objectSize)), _perSlab(perSlab ? perSlab : 1),
+  _free(0), _live(0), _freeCount(0), _lock(0), _nextPool(0)
+{
+    spinLock(&s_poolsLock);
+    _nextPool = s_pools;
+    s_pools = this;
+    spinUnlock(&s_poolsLock);
+}
+
+Pool::~Pool()
+{
+    spinLock(&s_poolsLock);
+    for (Pool **p = &s_pools; *p; p = &(*p)->_nextPool)
+    {
+        if (*p == this)
+        {
+            *p = _nextPool;
+            break;
+        }
+    }
+    spinUnlock(&s_poolsLock);
+    for (size_t i = 0; i < _slabs.size(); ++i)
+        ::operator delete(_slabs[i]);
+}
+
+void Pool::acquire()
+{
+    spinLock(&_lock);
+}
+
+void Pool::releaseLock()
+{
+    spinUnlock(&_lock);
+}
+
+// Caller holds _lock. Objects are threaded onto the free list back to
+// front so allocation walks the slab in address order.
+void Pool::grow()
+{
+    // Room for the slab pointer first, so a failure cannot leak the slab.
+    if (_slabs.size() == _slabs.capacity())
+        _slabs.reserve(_slabs.empty() ? 8 : 2 * _slabs.size());
+    char *slab = static_cast<char*>(::operator new(_objectSize * _perSlab));
+    _slabs.push_back(slab);
+    for (size_t i = _perSlab; i-- > 0; )
+    {
+        FreeNode *n = reinterpret_cast<FreeNode*>(slab + i * _objectSize);
+        n->next = _free;
+        _free = n;
+    }
+    _freeCount += _perSlab;
+}
+
+void *Pool::allocate()
+{
+    acquire();
+    if (!_free)
+    {
+        try
+        {
+            grow();
+        }
+        catch (...)
+        {
+            releaseLock();
+            throw;
+        }
+    }
+    FreeNode *n = _free;
+    _free = n->next;
+    --_freeCount;
+    ++_live;
+    releaseLock();
+    return n;
+}
+
+void Pool::release(void *p)
+{
+    if (!p)
+        return;
+    acquire();
+    FreeNode *n = static_cast<FreeNode*>(p);
+    n->next = _free;
+    _free = n;
+    ++_freeCount;
+    --_live;
+    releaseLock();
+}
+
+void Pool::reserve(size_t objects)
+{
+    acquire();
+    try
+    {
+        while (_freeCount < objects)
+            grow();
+    }
+    catch (...)
+    {
+        releaseLock();
+        throw;
+    }
+    releaseLock();
+}
+
+PoolStats Pool::stats()
+{
+    acquire();
+    PoolStats s;
+    s.name = _name;
+    s.objectSize = _objectSize;
+    s.live = _live;
+    s.free = _freeCount;
+    s.slabs = _slabs.size();
+    releaseLock();
+    return s;
+}
+
+void Pool::collect(std::vector<PoolStats> &out)
+{
+    spinLock(&s_poolsLock);
+    for (Pool *p = s_pools; p; p = p->_nextPool)
+        out.push_back(p->stats());
+    spinUnlock(&s_poolsLock);
+}
@@ -0,0 +1,119 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
+#include <cstddef>
+#include <vector>
+#include <memory>
+
+struct PoolStats
+{
+    const char *name;
+    size_t objectSize;
+    size_t live;
+    size_t free;
+    size_t slabs;
+};
+
+// Fixed-size object pool. Memory is carved from slabs of perSlab objects
+// and recycled through an intrusive free list; slabs are only returned
+// to the system when the pool itself is destroyed. Every pool registers
+// itself so stats can be collected across the process.
+class Pool
+{
+    private:
+        struct FreeNode
+        {
+            FreeNode *next;
+        };
+
+        const char *_name;
+        size_t _objectSize;
+        size_t _perSlab;
+        FreeNode *_free;
+        std::vector<char*> _slabs;
+        size_t _live;
+        size_t _freeCount;
+        int _lock;
+        Pool *_nextPool;
+
+        Pool(const Pool &);
+        Pool &operator=(const Pool &);
+
+        void grow();
+        void acquire();
+        void releaseLock();
+
+    public:
+        Pool(const char *name, size_t objectSize, size_t perSlab);
+        ~Pool();
+
+        void *allocate();
+        void release(void *p);
+        void reserve(size_t objects);
+        PoolStats stats();
+
+        static void collect(std::vector<PoolStats> &out);
+};
+
+// One shared pool per node size, used by PoolAllocator.
+template <size_t Size>
+Pool &nodePool()
+{
+    static Pool pool("node", Size, 1024);
+    return pool;
+}
+
+// Allocator for node-based containers: single-node allocations come
+// from the size-matched node pool, anything larger goes to the heap.
+template <typename T>
+class PoolAllocator
+{
+    public:
+        typedef T value_type;
+        typedef T *pointer;
+        typedef const T *const_pointer;
+        typedef T &reference;
+        typedef const T &const_reference;
+        typedef size_t size_type;
+        typedef ptrdiff_t difference_type;
+
+        template <typename U>
+        struct rebind
+        {
+            typedef PoolAllocator<U> other;
+        };
+
+        PoolAllocator() {}
+        PoolAllocator(const PoolAllocator &) {}
+        template <typename U>
+        PoolAllocator(const PoolAllocator<U> &) {}
+
+        pointer address(reference r) const { return &r; }
+        const_pointer address(const_reference r) const { return &r; }
+        size_type max_size() const { return size_t(-1) / sizeof(T); }
+
+        pointer allocate(size_type n, const void * = 0)
+        {
+            if (n == 1)
+                return static_cast<pointer>(nodePool<sizeof(T)>().allocate());
+            return static_cast<pointer>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(pointer p, size_type n)
+        {
+            if (n == 1)
+                nodePool<sizeof(T)>().release(p);
+            else
+                ::operator delete(p);
+        }
+
+        void construct(pointer p, const T &v) { new (static_cast<void*>(p)) T(v); }
+        void destroy(pointer p) { p->~T(); }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) { return false; }
+
+#endif
@@ -0,0 +1,45 @@
+#include "Scan.hpp"
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+# include <immintrin.h>
+#endif
+
+const char *scanByte(const char *p, const char *end, char c)
+{
+#if defined(__AVX2__)
+    const __m256i needle32 = _mm256_set1_epi8(c);
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        unsigned int m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle32));
+        if (m)
+            return p + __builtin_ctz(m);
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i needle16 = _mm_set1_epi8(c);
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned int m = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle16));
+        if (m)
+            return p + __builtin_ctz(m);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != c)
+        ++p;
+    return p;
+}
+
+const char *skipByte(const char *p, const char *end, char c)
+{
+    // Runs of separators are short; a scalar loop beats vector setup here.
+    while (p < end && *p == c)
+        ++p;
+    return p;
+}
@@ -0,0 +1,13 @@
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include <cstddef>
+
+// Returns the first occurrence of c in [p, end), or end. Uses AVX2 or
+// SSE2 when the build targets them and a scalar loop otherwise.
+const char *scanByte(const char *p, const char *end, char c);
+
+// Returns the first byte in [p, end) that is not c, or end.
+const char *skipByte(const char *p, const char *end, char c);
+
+#endif
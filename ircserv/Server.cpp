@@ -1,299 +1,324 @@
 #include "Server.hpp"
 #include "Commands.hpp"
 #include "Channel.hpp"
+#include "Handoff.hpp"
 #include <iostream>
 #include <stdexcept>
-#include <cstring>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <fcntl.h>
 #include <sstream>
-#include <cctype>
-
-Server* Server::s_instance = 0;
+#include <unistd.h>
 
-Server::Server(int port, const std::string &password)
-: _port(port), _password(password), _server_fd(-1), _running(false)
+Server::Server(int port, const std::string &password, const Config &config,
+               const std::string &backend, int threads)
+: _port(port), _password(password), _config(config), _backend(backend),
+  _threads(threads < 1 ? 1 : threads), _running(0), _upgrade(0), _argv(0), _nextClientId(0), _startTime(std::time(0)),
+  _snapshotDue(0)
 {
-    s_instance = this;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&_stateLock, &attr);
+    pthread_mutexattr_destroy(&attr);
 }
 
 Server::~Server()
 {
     stop();
-    std::map<std::string, Channel*>::iterator itc = _channels.begin();
-    for (; itc  !=  _channels.end(); ++itc)
-        delete itc->second;
-    std::map<int, Client*>::iterator it = _clients.begin();
-    for (; it != _clients.end(); ++it)
-        delete it->second;
+    for (size_t i = 0; i < _channels.capacity(); ++i)
+        delete _channels.slot(i);
+    for (size_t i = 0; i < _loops.size(); ++i)
+        delete _loops[i];
+    pthread_mutex_destroy(&_stateLock);
+}
+
+void Server::applyFloodCosts()
+{
+    const std::vector<FloodCost> &costs = _config.getFloodCosts();
+    for (size_t i = 0; i < costs.size(); ++i)
+    {
+        if (!Commands::setFloodCost(costs[i].command, costs[i].cost))
+            throw std::runtime_error("flood_cost: unknown command " + costs[i].command);
+    }
 }
 
-void Server::initSocket()
+// A capture carried over from the previous process is appended to, so
+// one file covers the whole run across upgrades.
+void Server::openCapture(unsigned long startNs, unsigned long salt)
 {
-    _server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (_server_fd < 0)
-        throw std::runtime_error("socket failed");
-
-    int opt = 1;
-    setsockopt(_server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-    sockaddr_in addr; std::memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(_port);
-
-    if (bind(_server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
-        throw std::runtime_error("bind failed");
-    if (listen(_server_fd, 128) < 0)
-        throw std::runtime_error("listen failed");
-    fcntl(_server_fd, F_SETFL, O_NONBLOCK);
-
-    pollfd p; p.fd = _server_fd; p.events = POLLIN; p.revents = 0;
-    _pollfds.push_back(p);
-    std::cout << "[Server] Listening on " << _port << std::endl;
+    if (_config.getCapturePath().empty())
+        return;
+    if (startNs)
+        _capture.resume(_config.getCapturePath(), _config.captureAnonymized(), startNs, salt);
+    else
+        _capture.open(_config.getCapturePath(), _config.captureAnonymized());
+    std::cout << "[Server] Capturing traffic to " << _config.getCapturePath()
+              << (_capture.anonymized() ? " (anonymized)" : "") << std::endl;
 }
 
 void Server::start()
 {
-    initSocket(); _running = true;
+    applyFloodCosts();
+    openCapture(0, 0);
+    if (!_config.getSnapshotPath().empty())
+    {
+        _snapshot.setPath(_config.getSnapshotPath());
+        _snapshot.load(*this);
+    }
+    for (int i = 0; i < _threads; ++i)
+    {
+        _loops.push_back(new EventLoop(*this, i, _backend));
+        _loops.back()->listen(_port, _threads > 1);
+    }
+    if (!_config.getMetricsSocket().empty())
+        _loops[0]->listenMetrics(_config.getMetricsSocket());
+    __atomic_store_n(&_running, 1, __ATOMIC_RELEASE);
+    std::cout << "[Server] Listening on " << _port << " (" << _loops[0]->backendName()
+              << ", " << _threads << (_threads > 1 ? " loops" : " loop") << ")" << std::endl;
 }
 
-void Server::stop()
+// The old process's listeners are reused in order; loops beyond them
+// open their own, which needs SO_REUSEPORT on the inherited ones too.
+// Channels come only from the handoff, the snapshot file is not read.
+void Server::adopt(int fd)
 {
-    for (size_t i = 0; i < _pollfds.size(); ++i)
-        close(_pollfds[i].fd);
-    _pollfds.clear();
-    _server_fd = -1;
-    _running = false;
+    applyFloodCosts();
+    Handoff handoff(fd);
+    handoff.receive();
+    openCapture(handoff.captureStartNs(), handoff.captureSalt());
+    if (!_config.getSnapshotPath().empty())
+        _snapshot.setPath(_config.getSnapshotPath());
+    for (int i = 0; i < _threads; ++i)
+    {
+        _loops.push_back(new EventLoop(*this, i, _backend));
+        if ((size_t)i < handoff.listenerCount())
+            _loops.back()->adoptListener(handoff.takeListener(i));
+        else
+            _loops.back()->listen(_port, true);
+    }
+    if (!_config.getMetricsSocket().empty())
+        _loops[0]->listenMetrics(_config.getMetricsSocket());
+    size_t clients = handoff.restore(*this);
+    handoff.confirm();
+    __atomic_store_n(&_running, 1, __ATOMIC_RELEASE);
+    std::cout << "[Server] Resumed " << clients << " clients and " << _channels.size()
+              << " channels on " << _port << " (" << _loops[0]->backendName() << ", "
+              << _threads << (_threads > 1 ? " loops" : " loop") << ")" << std::endl;
 }
 
-void Server::acceptNewClient()
+void Server::enableUpgrade(char *const argv[])
 {
-    sockaddr_in cli; socklen_t len = sizeof(cli);
-    int cfd = accept(_server_fd, (struct sockaddr*)&cli, &len);
-    if (cfd < 0)
-        return;
-    fcntl(cfd, F_SETFL, O_NONBLOCK);
-    pollfd p; p.fd = cfd; p.events = POLLIN; p.revents = 0;
-    _pollfds.push_back(p);
-    _clients[cfd] = new Client(cfd);
-    std::cout << "[Server] Client connected fd=" << cfd << std::endl;
+    _argv = argv;
 }
 
-void Server::receiveClientMessage(int fd)
+void Server::requestUpgrade()
 {
-    char buf[512];
-    int n = recv(fd, buf, sizeof(buf)-1, 0);
-    if (n <= 0)
-    {
-        std::cout << "[Server] Client disconnected fd=" << fd << std::endl;
-        removeClient(fd);
+    if (!_argv)
         return;
-    }
+    __atomic_store_n(&_upgrade, 1, __ATOMIC_RELEASE);
+    stop();
+}
 
-    buf[n] = '\0';
-    std::map<int, Client*>::iterator itc = _clients.find(fd);
-    if (itc == _clients.end())
-        return;
-    Client *cl = itc->second;
-    cl->appendToBuffer(buf);
+void Server::stop()
+{
+    __atomic_store_n(&_running, 0, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < _loops.size(); ++i)
+        _loops[i]->wake();
+}
+
+bool Server::isRunning() const
+{
+    return __atomic_load_n(&_running, __ATOMIC_ACQUIRE) != 0;
+}
 
+void Server::run()
+{
+    if (_loops.empty())
+        return;
+    if (_snapshot.enabled() && _config.getSnapshotInterval())
+    {
+        _snapshotDue = _loops[0]->now() + _config.getSnapshotInterval();
+        _snapshotTimer.setCallback(&Server::onSnapshotTimer, this);
+    }
     while (true)
     {
-        std::map<int, Client*>::iterator it_now = _clients.find(fd);
-        if (it_now == _clients.end())
+        for (size_t i = 1; i < _loops.size(); ++i)
+            _loops[i]->spawn();
+        if (_snapshotDue)
+            _loops[0]->timers().schedule(_snapshotTimer, _snapshotDue);
+        _loops[0]->run();
+        for (size_t i = 1; i < _loops.size(); ++i)
+            _loops[i]->join();
+        _snapshotTimer.cancel();
+
+        // After a handoff the sockets belong to the new process; nothing
+        // here may close them or remove its metrics socket.
+        if (!__atomic_exchange_n(&_upgrade, 0, __ATOMIC_ACQ_REL))
+            break;
+        if (Handoff::send(*this, _argv))
             return;
+        __atomic_store_n(&_running, 1, __ATOMIC_RELEASE);
+    }
+    if (_snapshot.enabled())
+    {
+        _snapshot.reap(true);
+        _snapshot.save(*this);
+    }
+    for (size_t i = 0; i < _loops.size(); ++i)
+        _loops[i]->closeAll();
+    if (!_config.getMetricsSocket().empty())
+        unlink(_config.getMetricsSocket().c_str());
+}
 
-        cl = it_now->second;
-        std::string line = cl->extractLine();
-        if (line.empty())
-            break;
+// Runs on loop 0. While a writer is running it is polled every 100 ms;
+// a new one is forked once the interval has passed.
+void Server::onSnapshotTimer(Timer &timer, void *arg)
+{
+    Server *server = static_cast<Server*>(arg);
+    EventLoop *loop = server->_loops[0];
+    unsigned long now = loop->now();
 
-        handleCommand(*cl, line);
+    server->_snapshot.reap(false);
+    if (!server->_snapshot.running() && now >= server->_snapshotDue)
+    {
+        StateGuard guard(*server);
+        server->_snapshot.start(*server);
+        server->_snapshotDue = now + server->_config.getSnapshotInterval();
     }
+    unsigned long next = server->_snapshotDue;
+    if (server->_snapshot.running() && now + 100 < next)
+        next = now + 100;
+    loop->timers().schedule(timer, next);
 }
 
-Channel* Server::getChannel(const std::string &name)
+void Server::closeInChild() const
 {
-    std::map<std::string, Channel*>::iterator it = _channels.find(name);
-    if (it != _channels.end())
-        return it->second;
-    Channel *ch = new Channel(name);
-    _channels[name] = ch;
-    return ch;
+    for (size_t i = 0; i < _loops.size(); ++i)
+        _loops[i]->closeInChild();
 }
 
-Client* Server::getClientByNickname(const std::string &nick)
+void Server::collectMetrics(Metrics &total) const
 {
-    std::map<int, Client*>::iterator it = _clients.begin();
-    for (; it != _clients.end(); ++it)
-    {
-        if (it->second && it->second->getNickname() == nick)
-            return it->second;
-    }
-    return 0;
+    for (size_t i = 0; i < _loops.size(); ++i)
+        _loops[i]->metrics().addTo(total);
 }
 
-Client* Server::getClientByFd(int fd)
+void Server::renderMetrics(std::string &out) const
 {
-    std::map<int, Client*>::iterator it = _clients.find(fd);
-    if (it == _clients.end()) return 0;
-    return it->second;
+    Metrics total;
+    collectMetrics(total);
+    total.renderPrometheus(out);
+
+    std::vector<PoolStats> pools;
+    Pool::collect(pools);
+    std::ostringstream os;
+    os << "# TYPE ircserv_pool_live_objects gauge\n";
+    for (size_t i = 0; i < pools.size(); ++i)
+        os << "ircserv_pool_live_objects{pool=\"" << pools[i].name << "\",size=\""
+           << pools[i].objectSize << "\"} " << pools[i].live << "\n";
+    os << "# TYPE ircserv_pool_free_objects gauge\n";
+    for (size_t i = 0; i < pools.size(); ++i)
+        os << "ircserv_pool_free_objects{pool=\"" << pools[i].name << "\",size=\""
+           << pools[i].objectSize << "\"} " << pools[i].free << "\n";
+    os << "# TYPE ircserv_uptime_seconds gauge\n"
+       << "ircserv_uptime_seconds " << std::time(0) - _startTime << "\n";
+    out += os.str();
 }
 
-std::map<std::string, Channel*>& Server::getChannels()
+void Server::lock()
 {
-    return _channels;
+    pthread_mutex_lock(&_stateLock);
 }
 
-void Server::enableWrite(int fd)
+void Server::unlock()
 {
-    for (size_t i = 0; i < _pollfds.size(); ++i)
-    {
-        if (_pollfds[i].fd == fd)
-        {
-            _pollfds[i].events |= POLLOUT;
-            return;
-        }
-    }
+    pthread_mutex_unlock(&_stateLock);
 }
 
-void Server::disableWrite(int fd)
+unsigned long Server::nextClientId()
 {
-    for (size_t i = 0; i < _pollfds.size(); ++i)
-    {
-        if (_pollfds[i].fd == fd)
-        {
-            _pollfds[i].events &= ~POLLOUT;
-            return;
-        }
-    }
+    return __atomic_add_fetch(&_nextClientId, 1, __ATOMIC_RELAXED);
 }
 
-void Server::removeClient(int fd)
+unsigned long Server::lastClientId() const
 {
-    for (size_t i = 0; i < _pollfds.size(); ++i)
-    {
-        if (_pollfds[i].fd == fd)
-        {
-            close(_pollfds[i].fd);
-            _pollfds.erase(_pollfds.begin() + i);
-            break;
-        }
-    }
+    return __atomic_load_n(&_nextClientId, __ATOMIC_RELAXED);
+}
 
-    std::map<int, Client*>::iterator it = _clients.find(fd);
-    if (it == _clients.end())
-        return;
+void Server::resumeClientIds(unsigned long last)
+{
+    __atomic_store_n(&_nextClientId, last, __ATOMIC_RELAXED);
+}
 
-    Client* victim = it->second;
+Channel* Server::getChannel(const std::string &name)
+{
+    Channel *ch = _channels.find(name);
+    if (ch)
+        return ch;
+    ch = new Channel(name);
+    _channels.insert(ch);
+    return ch;
+}
 
-    std::vector<std::string> emptyChannels;
-    for (std::map<std::string, Channel*>::iterator itc = _channels.begin();
-         itc != _channels.end(); ++itc)
-    {
-        Channel* ch = itc->second;
-        if (ch && ch->hasClient(victim))
-        {
-            ch->removeClient(victim);
-            if (ch->getClients().empty())
-                emptyChannels.push_back(itc->first);
-        }
-    }
+Channel* Server::findChannel(const Slice &name)
+{
+    return _channels.find(name.data, name.len);
+}
 
-    delete victim;
-    _clients.erase(it);
+void Server::destroyChannel(Channel *ch)
+{
+    _channels.erase(ch);
+    delete ch;
+}
 
-    for (size_t k = 0; k < emptyChannels.size(); ++k)
-    {
-        std::map<std::string, Channel*>::iterator cit = _channels.find(emptyChannels[k]);
-        if (cit != _channels.end())
-        {
-            delete cit->second;
-            _channels.erase(cit);
-        }
-    }
+Client* Server::getClientByNickname(const Slice &nick)
+{
+    return _nicks.find(nick.data, nick.len);
 }
 
-void Server::handleCommand(Client &client, const std::string &line)
+bool Server::renameClient(Client &client, const std::string &nick)
 {
-    std::istringstream iss(line);
-    std::string cmd; iss >> cmd;
-    std::string args; std::getline(iss, args);
-    
-    if (!args.empty() && args[0]==' ')
-        args.erase(0,1);
-    for (size_t i = 0; i < cmd.size(); ++i)
-        cmd[i] = (char)toupper(cmd[i]);
-
-    if (cmd == "PASS")
-        Commands::pass(*this, client, args);
-    else if (cmd == "NICK")
-        Commands::nick(*this, client, args);
-    else if (cmd == "USER")
-        Commands::user(*this, client, args);
-    else if (cmd == "JOIN")
-        Commands::join(*this, client, args);
-    else if (cmd == "PRIVMSG")
-        Commands::privmsg(*this, client, args);
-    else if (cmd == "KICK")
-        Commands::kick(*this, client, args);
-    else if (cmd == "INVITE")
-        Commands::invite(*this, client, args);
-    else if (cmd == "TOPIC")
-        Commands::topic(*this, client, args);
-    else if (cmd == "MODE")
-        Commands::mode(*this, client, args);
-    else if (cmd == "PING")
-        Commands::ping(*this, client, args);
-    else if (cmd == "CAP")
-        Commands::cap(*this, client, args);
-    else if (cmd == "NOTICE")
-        Commands::notice(*this, client, args);
-    else if (cmd == "WHO")
-        Commands::who(*this, client, args);
-    else if (cmd == "NAMES")
-        Commands::names(*this, client, args);
-    else if (cmd == "QUIT")
-        Commands::quit(*this, client, args);
-    else
-        std::cout << "[Server] Unknown command: " << cmd << std::endl;
+    Client *owner = _nicks.find(nick);
+    if (owner && owner != &client)
+        return false;
+
+    if (!client.getNickname().empty())
+        _nicks.erase(&client);
+    client.setNickname(nick);
+    _nicks.insert(&client);
+    return true;
 }
 
-void Server::run()
+NameIndex<Channel>& Server::getChannels()
 {
-    while (_running)
-    {
-        if (_pollfds.empty())
-            break;
+    return _channels;
+}
+
+void Server::removeClient(Client &client)
+{
+    client.getLoop()->removeClient(client.getFd());
+}
+
+void Server::detachClient(Client *victim)
+{
+    StateGuard guard(*this);
 
-        int ret = poll(&_pollfds[0], _pollfds.size(), 1000);
-        if (ret < 0)
-            continue;
-
-        for (size_t i = 0; i < _pollfds.size(); ++i)
-        {
-            short rev = _pollfds[i].revents;
-            if (!rev)
-                continue;
-
-            int fd = _pollfds[i].fd;
-
-            if (rev & POLLIN)
-            {
-                if (fd == _server_fd)
-                    acceptNewClient();
-                else
-                    receiveClientMessage(fd);
-            }
-            if (rev & POLLOUT)
-            {
-                Client* c = getClientByFd(fd);
-                if (c)
-                    c->flushSend();
-            }
-        }
+    std::vector<Channel*> joined(victim->getChannels().begin(), victim->getChannels().end());
+    std::vector<Channel*> emptyChannels;
+    for (size_t i = 0; i < joined.size(); ++i)
+    {
+        Channel* ch = joined[i];
+        ch->removeClient(victim);
+        if (ch->memberCount() == 0)
+            emptyChannels.push_back(ch);
     }
+
+    // Invitations are keyed by Client*, which the pool hands out again.
+    std::vector<Channel*> invited(victim->getInvites().begin(), victim->getInvites().end());
+    for (size_t i = 0; i < invited.size(); ++i)
+        invited[i]->removeInvitation(victim);
+
+    if (!victim->getNickname().empty())
+        _nicks.erase(victim);
+
+    for (size_t k = 0; k < emptyChannels.size(); ++k)
+        destroyChannel(emptyChannels[k]);
 }
@@ -1,52 +1,108 @@
 #ifndef SERVER_HPP
 #define SERVER_HPP
 
-#include <map>
 #include <vector>
 #include <string>
-#include <poll.h>
+#include <pthread.h>
+#include <ctime>
 #include "Client.hpp"
 #include "Channel.hpp"
+#include "EventLoop.hpp"
+#include "NameIndex.hpp"
+#include "Config.hpp"
+#include "Capture.hpp"
+#include "Snapshot.hpp"
+#include "TimerWheel.hpp"
 
+// Shared server state: configuration, the nick and channel indices and
+// the event loops. Channel and nick state is guarded by one lock that a
+// loop holds while it runs commands or tears a client down.
 class Server
 {
     private:
         int _port;
         std::string _password;
-        int _server_fd;
-        bool _running;
-        std::vector<pollfd> _pollfds;
-        std::map<int, Client*> _clients;
-        std::map<std::string, Channel*> _channels;
+        Config _config;
+        std::string _backend;
+        int _threads;
+        int _running;
+        int _upgrade;
+        char *const *_argv;
+        std::vector<EventLoop*> _loops;
+        NameIndex<Client> _nicks;
+        NameIndex<Channel> _channels;
+        pthread_mutex_t _stateLock;
+        unsigned long _nextClientId;
+        time_t _startTime;
+        Capture _capture;
+        Snapshot _snapshot;
+        Timer _snapshotTimer;
+        unsigned long _snapshotDue;
 
-        static Server* s_instance;
+        Server(const Server &);
+        Server &operator=(const Server &);
 
-        void initSocket();
-        void acceptNewClient();
-        void receiveClientMessage(int fd);
-        void handleCommand(Client &client, const std::string &line);
+        static void onSnapshotTimer(Timer &timer, void *arg);
+        void applyFloodCosts();
+        void openCapture(unsigned long startNs, unsigned long salt);
 
     public:
-        Server(int port, const std::string &password);
+        Server(int port, const std::string &password, const Config &config = Config(),
+               const std::string &backend = "", int threads = 1);
         ~Server();
 
-        static Server* instance() { return s_instance; }
-
         void start();
         void stop();
         void run();
+        bool isRunning() const;
 
-        std::map<std::string, Channel*>& getChannels();
-        void removeClient(int fd);
+        // Hot upgrade: enableUpgrade() keeps the command line to exec,
+        // requestUpgrade() is signal safe and makes run() hand everything
+        // to a new process, which starts with adopt() instead of start().
+        void enableUpgrade(char *const argv[]);
+        void requestUpgrade();
+        void adopt(int fd);
 
-        Channel* getChannel(const std::string &name);
-        Client* getClientByNickname(const std::string &nick);
+        void lock();
+        void unlock();
+        unsigned long nextClientId();
+        unsigned long lastClientId() const;
+        void resumeClientIds(unsigned long last);
+        const std::vector<EventLoop*> &loops() const { return _loops; }
+        // For a forked child: drops its copies of every socket, so clients
+        // and listeners close when the parent closes them.
+        void closeInChild() const;
+
+        NameIndex<Channel>& getChannels();
+        void removeClient(Client &client);
+        void detachClient(Client *client);
 
-        Client* getClientByFd(int fd);
-        void enableWrite(int fd);
-        void disableWrite(int fd);
+        Channel* getChannel(const std::string &name);
+        Channel* findChannel(const Slice &name);
+        void destroyChannel(Channel *ch);
+        Client* getClientByNickname(const Slice &nick);
+        bool renameClient(Client &client, const std::string &nick);
 
         const std::string &getPassword() const { return _password; }
+        const Config &getConfig() const { return _config; }
+        time_t getStartTime() const { return _startTime; }
+        Capture &capture() { return _capture; }
+
+        void collectMetrics(Metrics &total) const;
+        void renderMetrics(std::string &out) const;
+};
+
+class StateGuard
+{
+    private:
+        Server &_server;
+
+        StateGuard(const StateGuard &);
+        StateGuard &operator=(const StateGuard &);
+
+    public:
+        explicit StateGuard(Server &server) : _server(server) { _server.lock(); }
+        ~StateGuard() { _server.unlock(); }
 };
 
 #endif
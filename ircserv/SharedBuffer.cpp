@@ -0,0 +1,93 @@
+#include "SharedBuffer.hpp"
+#include <cstring>
+#include <new>
+
+SharedBuffer::SharedBuffer()
+: _h(0)
+{}
+
+SharedBuffer::SharedBuffer(const std::string &data)
+: _h(0)
+{
+    *this = SharedBuffer(data.data(), data.size());
+}
+
+SharedBuffer::SharedBuffer(const char *data, size_t len)
+: _h(0)
+{
+    if (!len)
+        return;
+    _h = static_cast<Header*>(::operator new(sizeof(Header) + len));
+    _h->refs = 1;
+    _h->size = len;
+    std::memcpy(_h + 1, data, len);
+}
+
+SharedBuffer SharedBuffer::concat(const Slice *parts, size_t count)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < count; ++i)
+        len += parts[i].len;
+
+    SharedBuffer buf;
+    if (!len)
+        return buf;
+    buf._h = static_cast<Header*>(::operator new(sizeof(Header) + len));
+    buf._h->refs = 1;
+    buf._h->size = len;
+    char *out = reinterpret_cast<char*>(buf._h + 1);
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::memcpy(out, parts[i].data, parts[i].len);
+        out += parts[i].len;
+    }
+    return buf;
+}
+
+SharedBuffer::SharedBuffer(const SharedBuffer &other)
+: _h(other._h)
+{
+    if (_h)
+        __atomic_add_fetch(&_h->refs, 1, __ATOMIC_RELAXED);
+}
+
+SharedBuffer &SharedBuffer::operator=(const SharedBuffer &other)
+{
+    if (other._h)
+        __atomic_add_fetch(&other._h->refs, 1, __ATOMIC_RELAXED);
+    release();
+    _h = other._h;
+    return *this;
+}
+
+SharedBuffer::~SharedBuffer()
+{
+    release();
+}
+
+void SharedBuffer::release()
+{
+    if (_h && __atomic_sub_fetch(&_h->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        ::operator delete(_h);
+    _h = 0;
+}
+
+const char *SharedBuffer::data() const
+{
+    return _h ? reinterpret_cast<const char*>(_h + 1) : "";
+}
+
+size_t SharedBuffer::size() const
+{
+    return _h ? _h->size : 0;
+}
+
+bool SharedBuffer::empty() const
+{
+    return !_h;
+}
+
+size_t SharedBuffer::useCount() const
+{
+    return _h ? __atomic_load_n(&_h->refs, __ATOMIC_RELAXED) : 0;
+}
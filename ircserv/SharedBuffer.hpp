@@ -0,0 +1,41 @@
+#ifndef SHAREDBUFFER_HPP
+#define SHAREDBUFFER_HPP
+
+#include <string>
+#include <cstddef>
+#include "Slice.hpp"
+
+// Immutable, reference-counted byte buffer. A message is encoded once
+// and every recipient's send queue holds a handle to the same bytes.
+// The count is atomic because handles cross event loop threads.
+class SharedBuffer
+{
+    private:
+        struct Header
+        {
+            size_t refs;
+            size_t size;
+        };
+
+        Header *_h;
+
+        void release();
+
+    public:
+        SharedBuffer();
+        explicit SharedBuffer(const std::string &data);
+        SharedBuffer(const char *data, size_t len);
+        SharedBuffer(const SharedBuffer &other);
+        SharedBuffer &operator=(const SharedBuffer &other);
+        ~SharedBuffer();
+
+        const char *data() const;
+        size_t size() const;
+        bool empty() const;
+        size_t useCount() const;
+
+        // Encodes the concatenation of parts with a single allocation.
+        static SharedBuffer concat(const Slice *parts, size_t count);
+};
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef SLICE_HPP
+#define SLICE_HPP
+
+#include <string>
+#include <cstddef>
+#include <cstring>
+
+// Non-owning view of bytes that live in someone else's buffer.
+struct Slice
+{
+    const char *data;
+    size_t len;
+
+    Slice() : data(""), len(0) {}
+    Slice(const char *d, size_t n) : data(d), len(n) {}
+    Slice(const char *s) : data(s), len(std::strlen(s)) {}
+    Slice(const std::string &s) : data(s.data()), len(s.size()) {}
+
+    bool empty() const { return len == 0; }
+    char operator[](size_t i) const { return data[i]; }
+    std::string str() const { return std::string(data, len); }
+};
+
+#endif
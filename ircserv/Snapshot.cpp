@@ -0,0 +1,240 @@
+#include "Snapshot.hpp"
+#include "Server.hpp"
+#include "Metrics.hpp"
+#include "Codec.hpp"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static const char MAGIC[] = "IRCSNAP1";
+static const size_t MAGIC_LEN = sizeof(MAGIC) - 1;
+
+enum
+{
+    FLAG_INVITE_ONLY = 1,
+    FLAG_TOPIC_RESTRICTED = 2
+};
+
+Snapshot::Snapshot()
+: _child(-1), _startedMs(0), _forkUs(0)
+{}
+
+Snapshot::~Snapshot()
+{
+    reap(true);
+}
+
+void Snapshot::setPath(const std::string &path)
+{
+    _path = path;
+    _tmpPath = path + ".tmp";
+}
+
+size_t Snapshot::encode(Server &server, char *out)
+{
+    Encoder enc(out);
+    NameIndex<Channel> &channels = server.getChannels();
+    enc.bytes(MAGIC, MAGIC_LEN);
+    enc.u32((unsigned int)channels.size());
+    for (size_t i = 0; i < channels.capacity(); ++i)
+    {
+        const Channel *ch = channels.slot(i);
+        if (!ch)
+            continue;
+        enc.str(ch->getName());
+        enc.str(ch->getTopic());
+        enc.str(ch->getKey());
+        enc.u32((unsigned int)ch->getLimit());
+        enc.u8((ch->isInviteOnly() ? FLAG_INVITE_ONLY : 0)
+               | (ch->isTopicRestricted() ? FLAG_TOPIC_RESTRICTED : 0));
+
+        const Membership *m = ch->members();
+        const std::vector<std::string> &saved = ch->savedOperators();
+        unsigned int ops = (unsigned int)saved.size();
+        for (size_t j = 0; j < ch->memberCount(); ++j)
+            ops += (m[j].modes & MemberTable::OP) != 0;
+        enc.u32(ops);
+        for (size_t j = 0; j < ch->memberCount(); ++j)
+        {
+            if (m[j].modes & MemberTable::OP)
+                enc.str(m[j].client->getNickname());
+        }
+        for (size_t j = 0; j < saved.size(); ++j)
+            enc.str(saved[j]);
+    }
+    if (out)
+        enc.u64(fnv1a(out, enc.len));
+    else
+        enc.len += 8;
+    return enc.len;
+}
+
+bool Snapshot::writeFile(Server &server) const
+{
+    size_t size = encode(server, 0);
+    void *mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return false;
+    encode(server, static_cast<char*>(mem));
+
+    bool ok = false;
+    int fd = ::open(_tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0)
+    {
+        const char *p = static_cast<const char*>(mem);
+        size_t off = 0;
+        while (off < size)
+        {
+            ssize_t n = ::write(fd, p + off, size - off);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            off += (size_t)n;
+        }
+        ok = off == size && fsync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+        ok = ok && std::rename(_tmpPath.c_str(), _path.c_str()) == 0;
+        if (!ok)
+            unlink(_tmpPath.c_str());
+    }
+    munmap(mem, size);
+    return ok;
+}
+
+size_t Snapshot::load(Server &server)
+{
+    int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+            std::cout << "[Server] Cannot read snapshot " << _path << ": "
+                      << std::strerror(errno) << std::endl;
+        return 0;
+    }
+
+    unsigned long t0 = Metrics::monotonicNs();
+    struct stat st;
+    void *mem = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        mem = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+    {
+        std::cout << "[Server] Cannot map snapshot " << _path << std::endl;
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *data = static_cast<const char*>(mem);
+    madvise(mem, size, MADV_SEQUENTIAL);
+
+    unsigned long sum = 0;
+    if (size >= MAGIC_LEN + 4 + 8)
+        std::memcpy(&sum, data + size - 8, 8);
+    if (size < MAGIC_LEN + 4 + 8 || std::memcmp(data, MAGIC, MAGIC_LEN) != 0
+        || fnv1a(data, size - 8) != sum)
+    {
+        std::cout << "[Server] Ignoring damaged or unknown snapshot " << _path << std::endl;
+        munmap(mem, size);
+        return 0;
+    }
+
+    Decoder dec(data + MAGIC_LEN, data + size - 8);
+    unsigned int count = dec.u32();
+    size_t restored = 0;
+    for (unsigned int i = 0; i < count && dec.ok; ++i)
+    {
+        std::string name = dec.str();
+        std::string topic = dec.str();
+        std::string key = dec.str();
+        unsigned int limit = dec.u32();
+        unsigned char flags = dec.u8();
+        unsigned int ops = dec.u32();
+        if (!dec.ok || name.empty() || name[0] != '#')
+            break;
+
+        Channel *ch = server.getChannel(name);
+        ch->setTopic(topic);
+        ch->setKey(key);
+        ch->setLimit(limit);
+        ch->setInviteOnly((flags & FLAG_INVITE_ONLY) != 0);
+        ch->setTopicRestricted((flags & FLAG_TOPIC_RESTRICTED) != 0);
+        for (unsigned int j = 0; j < ops && dec.ok; ++j)
+            ch->addSavedOperator(dec.str());
+        ++restored;
+    }
+    munmap(mem, size);
+
+    if (!dec.ok || restored != count)
+        std::cout << "[Server] Snapshot " << _path << " is truncated" << std::endl;
+    std::cout << "[Server] Restored " << restored << " channels from " << _path << " in "
+              << (Metrics::monotonicNs() - t0) / 1000 / 1000.0 << " ms" << std::endl;
+    return restored;
+}
+
+bool Snapshot::start(Server &server)
+{
+    reap(false);
+    if (running())
+        return false;
+
+    unsigned long t0 = Metrics::monotonicNs();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        std::cout << "[Server] Snapshot fork failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (pid == 0)
+    {
+        server.closeInChild();
+        _exit(writeFile(server) ? 0 : 1);
+    }
+
+    unsigned long t1 = Metrics::monotonicNs();
+    _child = pid;
+    _startedMs = t0 / 1000000;
+    _forkUs = (t1 - t0) / 1000;
+    return true;
+}
+
+void Snapshot::reap(bool wait)
+{
+    if (_child <= 0)
+        return;
+    int status = 0;
+    pid_t r;
+    do
+        r = waitpid(_child, &status, wait ? 0 : WNOHANG);
+    while (r < 0 && errno == EINTR);
+    if (r == 0)
+        return;
+
+    unsigned long ms = Metrics::monotonicNs() / 1000000 - _startedMs;
+    if (r == _child && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        std::cout << "[Server] Snapshot written to " << _path << " in " << ms
+                  << " ms (fork " << _forkUs << " us)" << std::endl;
+    else
+        std::cout << "[Server] Snapshot to " << _path << " failed" << std::endl;
+    _child = -1;
+}
+
+bool Snapshot::save(Server &server)
+{
+    unsigned long t0 = Metrics::monotonicNs();
+    if (!writeFile(server))
+    {
+        std::cout << "[Server] Snapshot to " << _path << " failed: "
+                  << std::strerror(errno) << std::endl;
+        return false;
+    }
+    std::cout << "[Server] Snapshot written to " << _path << " in "
+              << (Metrics::monotonicNs() - t0) / 1000 / 1000.0 << " ms" << std::endl;
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <string>
+#include <cstddef>
+#include <sys/types.h>
+
+class Server;
+
+// Channel state snapshots for fast restarts. The file is
+//
+//   "IRCSNAP1", u32 channel count, channels..., u64 checksum
+//
+// with each channel stored as name, topic, key, u32 limit, u8 flags
+// (1 = +i, 2 = +t), u32 operator count and the operator nicks; strings
+// are a u32 length and the bytes, integers are host order and the
+// checksum is FNV-1a over everything before it. A file is always written
+// whole to <path>.tmp and renamed over <path>.
+//
+// Periodic snapshots are taken in a forked child, which sees a
+// copy-on-write image of the state at fork time and encodes it without
+// allocating, so the loops only stall for the fork itself.
+class Snapshot
+{
+    private:
+        std::string _path;
+        std::string _tmpPath;
+        pid_t _child;
+        unsigned long _startedMs;
+        unsigned long _forkUs;
+
+        Snapshot(const Snapshot &);
+        Snapshot &operator=(const Snapshot &);
+
+        static size_t encode(Server &server, char *out);
+        bool writeFile(Server &server) const;
+
+    public:
+        Snapshot();
+        ~Snapshot();
+
+        void setPath(const std::string &path);
+        bool enabled() const { return !_path.empty(); }
+        bool running() const { return _child > 0; }
+        const std::string &path() const { return _path; }
+
+        // Recreates the snapshot's channels; returns how many. A missing
+        // file restores nothing, a damaged one is logged and ignored.
+        size_t load(Server &server);
+
+        // Forks a writer unless one is still running. The caller holds the
+        // state lock.
+        bool start(Server &server);
+        // Reaps a finished writer; with wait, blocks until it exits.
+        void reap(bool wait);
+        // Writes the snapshot from this process, e.g. on shutdown.
+        bool save(Server &server);
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include "TimerWheel.hpp"
+#include <climits>
+
+static void listInit(TimerLink &head)
+{
+    head.prev = head.next = &head;
+}
+
+static bool listEmpty(const TimerLink &head)
+{
+    return head.next == &head;
+}
+
+static void listUnlink(TimerLink &l)
+{
+    l.prev->next = l.next;
+    l.next->prev = l.prev;
+    l.prev = l.next = &l;
+}
+
+static void listAppend(TimerLink &head, TimerLink &l)
+{
+    l.prev = head.prev;
+    l.next = &head;
+    head.prev->next = &l;
+    head.prev = &l;
+}
+
+// Moves every entry of from onto the empty list to.
+static void listSplice(TimerLink &from, TimerLink &to)
+{
+    listInit(to);
+    if (listEmpty(from))
+        return;
+    to.next = from.next;
+    to.prev = from.prev;
+    to.next->prev = &to;
+    to.prev->next = &to;
+    listInit(from);
+}
+
+static unsigned levelShift(int level)
+{
+    return TimerWheel::ROOT_BITS + (level - 1) * TimerWheel::LEVEL_BITS;
+}
+
+Timer::Timer(TimerCallback callback, void *arg)
+: _wheel(0), _expires(0), _callback(callback), _arg(arg)
+{
+    prev = next = this;
+}
+
+Timer::~Timer()
+{
+    cancel();
+}
+
+void Timer::setCallback(TimerCallback callback, void *arg)
+{
+    _callback = callback;
+    _arg = arg;
+}
+
+void Timer::cancel()
+{
+    if (_wheel)
+        _wheel->cancel(*this);
+}
+
+TimerWheel::TimerWheel(unsigned long nowMs)
+: _tick(nowMs / TICK_MS), _count(0)
+{
+    for (int i = 0; i < ROOT_SIZE; ++i)
+        listInit(_root[i]);
+    for (int l = 0; l < LEVELS - 1; ++l)
+        for (int i = 0; i < LEVEL_SIZE; ++i)
+            listInit(_levels[l][i]);
+}
+
+void TimerWheel::place(Timer &timer)
+{
+    unsigned long expires = timer._expires;
+    if (expires < _tick)
+        expires = _tick;
+    unsigned long delta = expires - _tick;
+
+    if (delta < (unsigned long)ROOT_SIZE)
+    {
+        listAppend(_root[expires & (ROOT_SIZE - 1)], timer);
+        return;
+    }
+    for (int level = 1; level < LEVELS; ++level)
+    {
+        unsigned shift = levelShift(level);
+        if (delta < (1UL << (shift + LEVEL_BITS)) || level == LEVELS - 1)
+        {
+            // Beyond the last level the timer waits in its furthest slot
+            // and is re-placed from there.
+            if (delta >= (1UL << (shift + LEVEL_BITS)))
+                expires = _tick + (1UL << (shift + LEVEL_BITS)) - 1;
+            listAppend(_levels[level - 1][(expires >> shift) & (LEVEL_SIZE - 1)], timer);
+            return;
+        }
+    }
+}
+
+void TimerWheel::schedule(Timer &timer, unsigned long whenMs)
+{
+    if (timer._wheel)
+        cancel(timer);
+    timer._expires = (whenMs + TICK_MS - 1) / TICK_MS;
+    timer._wheel = this;
+    ++_count;
+    place(timer);
+}
+
+void TimerWheel::cancel(Timer &timer)
+{
+    if (timer._wheel != this)
+        return;
+    listUnlink(timer);
+    timer._wheel = 0;
+    --_count;
+}
+
+void TimerWheel::cascade(int level, size_t index)
+{
+    TimerLink pending;
+    listSplice(_levels[level - 1][index], pending);
+    while (!listEmpty(pending))
+    {
+        Timer &t = static_cast<Timer&>(*pending.next);
+        listUnlink(t);
+        place(t);
+    }
+}
+
+// Callbacks may cancel or re-arm any timer, including others in the
+// batch being run, so each one is detached before it is called.
+void TimerWheel::expire(TimerLink &slot)
+{
+    TimerLink due;
+    listSplice(slot, due);
+    while (!listEmpty(due))
+    {
+        Timer &t = static_cast<Timer&>(*due.next);
+        listUnlink(t);
+        t._wheel = 0;
+        --_count;
+        if (t._callback)
+            t._callback(t, t._arg);
+    }
+}
+
+void TimerWheel::advance(unsigned long nowMs)
+{
+    unsigned long now = nowMs / TICK_MS;
+    while (_tick <= now)
+    {
+        if (_count == 0)
+        {
+            _tick = now + 1;
+            return;
+        }
+        size_t index = _tick & (ROOT_SIZE - 1);
+        for (int level = 1; index == 0 && level < LEVELS; ++level)
+        {
+            index = (_tick >> levelShift(level)) & (LEVEL_SIZE - 1);
+            cascade(level, index);
+        }
+        TimerLink &slot = _root[_tick & (ROOT_SIZE - 1)];
+        ++_tick;
+        expire(slot);
+    }
+}
+
+// Earliest tick at which advance() has work: either a due root slot or
+// the cascade of the next non-empty slot of a higher level.
+unsigned long TimerWheel::nextTick() const
+{
+    unsigned long best = ULONG_MAX;
+    for (int i = 0; i < ROOT_SIZE; ++i)
+    {
+        if (!listEmpty(_root[(_tick + i) & (ROOT_SIZE - 1)]))
+        {
+            best = _tick + i;
+            break;
+        }
+    }
+    for (int level = 1; level < LEVELS; ++level)
+    {
+        unsigned shift = levelShift(level);
+        unsigned long base = _tick >> shift;
+        unsigned long first = (_tick & ((1UL << shift) - 1)) == 0 ? 0 : 1;
+        for (unsigned long d = first; d <= (unsigned long)LEVEL_SIZE; ++d)
+        {
+            if (!listEmpty(_levels[level - 1][(base + d) & (LEVEL_SIZE - 1)]))
+            {
+                unsigned long at = (base + d) << shift;
+                if (at < best)
+                    best = at;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+int TimerWheel::timeoutMs(unsigned long nowMs) const
+{
+    if (_count == 0)
+        return -1;
+    unsigned long at = nextTick() * TICK_MS;
+    if (at <= nowMs)
+        return 0;
+    unsigned long wait = at - nowMs;
+    return wait > (unsigned long)INT_MAX ? INT_MAX : (int)wait;
+}
@@ -0,0 +1,86 @@
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <cstddef>
+
+class TimerWheel;
+class Timer;
+
+typedef void (*TimerCallback)(Timer &timer, void *arg);
+
+struct TimerLink
+{
+    TimerLink *prev;
+    TimerLink *next;
+};
+
+// Intrusive timer: embed it in the object it belongs to. Arming, re-arming
+// and cancelling only relink it, so none of them allocate.
+class Timer : private TimerLink
+{
+    private:
+        TimerWheel *_wheel;
+        unsigned long _expires;
+        TimerCallback _callback;
+        void *_arg;
+
+        Timer(const Timer &);
+        Timer &operator=(const Timer &);
+
+        friend class TimerWheel;
+
+    public:
+        Timer(TimerCallback callback = 0, void *arg = 0);
+        ~Timer();
+
+        void setCallback(TimerCallback callback, void *arg);
+        bool armed() const { return _wheel != 0; }
+        void cancel();
+};
+
+// Hierarchical hashed timer wheel with TICK_MS resolution. Level 0 covers
+// the next 256 ticks one slot per tick; each further level covers 64 times
+// the span of the one below and is cascaded down as time reaches it.
+class TimerWheel
+{
+    public:
+        enum
+        {
+            TICK_MS = 10,
+            LEVELS = 4,
+            ROOT_BITS = 8,
+            LEVEL_BITS = 6,
+            ROOT_SIZE = 1 << ROOT_BITS,
+            LEVEL_SIZE = 1 << LEVEL_BITS
+        };
+
+    private:
+        TimerLink _root[ROOT_SIZE];
+        TimerLink _levels[LEVELS - 1][LEVEL_SIZE];
+        unsigned long _tick;
+        size_t _count;
+
+        TimerWheel(const TimerWheel &);
+        TimerWheel &operator=(const TimerWheel &);
+
+        void place(Timer &timer);
+        void cascade(int level, size_t index);
+        void expire(TimerLink &slot);
+        unsigned long nextTick() const;
+
+    public:
+        explicit TimerWheel(unsigned long nowMs);
+
+        // Fires timer at or after whenMs; re-arms it if already armed.
+        void schedule(Timer &timer, unsigned long whenMs);
+        void cancel(Timer &timer);
+
+        // Runs every timer that is due at nowMs.
+        void advance(unsigned long nowMs);
+
+        // Milliseconds the loop may sleep, or -1 when nothing is armed.
+        int timeoutMs(unsigned long nowMs) const;
+        size_t size() const { return _count; }
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef LATENCYHIST_HPP
+#define LATENCYHIST_HPP
+
+#include <cstddef>
+#include <vector>
+
+// Log-linear histogram: 64 linear sub-buckets per power of two, so any
+// reported quantile is within ~1.6% of the recorded value.
+class LatencyHist
+{
+    private:
+        std::vector<unsigned long> _counts;
+        unsigned long _n;
+        unsigned long _max;
+
+        static size_t index(unsigned long v)
+        {
+            if (v < 128)
+                return v;
+            int shift = 63 - __builtin_clzl(v) - 6;
+            return shift * 64 + (v >> shift);
+        }
+
+        static unsigned long lower(size_t b)
+        {
+            if (b < 128)
+                return b;
+            int shift = b / 64 - 1;
+            return (unsigned long)(b - shift * 64) << shift;
+        }
+
+    public:
+        LatencyHist() : _counts(64 * 60, 0), _n(0), _max(0) {}
+
+        void add(unsigned long v)
+        {
+            ++_counts[index(v)];
+            ++_n;
+            if (v > _max)
+                _max = v;
+        }
+
+        unsigned long count() const { return _n; }
+        unsigned long max() const { return _max; }
+
+        unsigned long quantile(double q) const
+        {
+            if (!_n)
+                return 0;
+            unsigned long want = (unsigned long)(q * _n);
+            if (want >= _n)
+                want = _n - 1;
+            unsigned long seen = 0;
+            for (size_t b = 0; b < _counts.size(); ++b)
+            {
+                seen += _counts[b];
+                if (seen > want)
+                    return (lower(b) + lower(b + 1)) / 2;
+            }
+            return _max;
+        }
+};
+
+#endif
@@ -0,0 +1,643 @@
+// Synthetic IRC client swarm.
+//
+// Opens N connections from one epoll loop, registers them, joins channels
+// and then runs one of the scenarios below for a fixed duration:
+//
+//   chat   senders post at a fixed total rate to channels they are in
+//   hot    every client sits in one channel; senders post to it
+//   idle   connections only register, join and answer PINGs
+//   storm  clients are dropped and reconnected at a fixed rate
+//
+// Message bodies carry the CLOCK_MONOTONIC send time, so every delivery
+// gives an end-to-end fan-out latency. The server should run with flood
+// control off for the sending clients (e.g. class default flood_penalty=0).
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "LatencyHist.hpp"
+
+static unsigned long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+enum Scenario
+{
+    CHAT,
+    HOT,
+    IDLE,
+    STORM
+};
+
+enum ConnState
+{
+    DOWN,
+    CONNECTING,
+    REGISTERING,
+    JOINING,
+    READY
+};
+
+struct Conn
+{
+    int fd;
+    int state;
+    unsigned gen;
+    size_t joined;
+    unsigned long started;
+    std::string in;
+    std::string out;
+    std::vector<int> channels;
+};
+
+struct Options
+{
+    const char *host;
+    int port;
+    const char *password;
+    Scenario scenario;
+    int conns;
+    int channels;
+    int perClient;
+    bool zipf;
+    int senders;
+    double rate;
+    double duration;
+    int payload;
+    int parallel;
+    int sources;
+};
+
+static Options g_opt;
+static std::vector<Conn> g_conns;
+static std::vector<int> g_members;
+static int g_epoll = -1;
+static unsigned g_seed = 12345;
+
+static unsigned long g_ready = 0;
+static unsigned long g_sent = 0;
+static unsigned long g_expected = 0;
+static unsigned long g_delivered = 0;
+static unsigned long g_reconnects = 0;
+static unsigned long g_pings = 0;
+static unsigned long g_errors = 0;
+static bool g_measuring = false;
+static LatencyHist g_fanout;
+static LatencyHist g_register;
+
+static unsigned nextRand()
+{
+    g_seed ^= g_seed << 13;
+    g_seed ^= g_seed >> 17;
+    g_seed ^= g_seed << 5;
+    return g_seed;
+}
+
+static void usage()
+{
+    std::fprintf(stderr,
+        "usage: ircbench [options]\n"
+        "  -s chat|hot|idle|storm  scenario (chat)\n"
+        "  -H host -p port -w pass server and password (127.0.0.1 6667 pw)\n"
+        "  -c N                    connections (100)\n"
+        "  -m M                    channels (10; hot forces 1)\n"
+        "  -k K                    channels joined per client (1)\n"
+        "  -d uniform|zipf         channel membership distribution (uniform)\n"
+        "  -n S                    sending clients (10)\n"
+        "  -r R                    messages/s in total, or reconnects/s for storm (100)\n"
+        "  -t T                    measured seconds (10)\n"
+        "  -l B                    message payload bytes (64)\n"
+        "  -P P                    connections set up concurrently (64)\n"
+        "  -b B                    source addresses 127.0.0.1..B for >60k loopback conns (1)\n");
+    std::exit(2);
+}
+
+static void parseOptions(int argc, char **argv)
+{
+    Options &o = g_opt;
+    o.host = "127.0.0.1";
+    o.port = 6667;
+    o.password = "pw";
+    o.scenario = CHAT;
+    o.conns = 100;
+    o.channels = 10;
+    o.perClient = 1;
+    o.zipf = false;
+    o.senders = 10;
+    o.rate = 100;
+    o.duration = 10;
+    o.payload = 64;
+    o.parallel = 64;
+    o.sources = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "s:H:p:w:c:m:k:d:n:r:t:l:P:b:")) != -1)
+    {
+        std::string v = optarg ? optarg : "";
+        switch (c)
+        {
+            case 's':
+                if (v == "chat") o.scenario = CHAT;
+                else if (v == "hot") o.scenario = HOT;
+                else if (v == "idle") o.scenario = IDLE;
+                else if (v == "storm") o.scenario = STORM;
+                else usage();
+                break;
+            case 'H': o.host = optarg; break;
+            case 'p': o.port = std::atoi(optarg); break;
+            case 'w': o.password = optarg; break;
+            case 'c': o.conns = std::atoi(optarg); break;
+            case 'm': o.channels = std::atoi(optarg); break;
+            case 'k': o.perClient = std::atoi(optarg); break;
+            case 'd':
+                if (v == "zipf") o.zipf = true;
+                else if (v != "uniform") usage();
+                break;
+            case 'n': o.senders = std::atoi(optarg); break;
+            case 'r': o.rate = std::atof(optarg); break;
+            case 't': o.duration = std::atof(optarg); break;
+            case 'l': o.payload = std::atoi(optarg); break;
+            case 'P': o.parallel = std::atoi(optarg); break;
+            case 'b': o.sources = std::atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (o.scenario == HOT)
+    {
+        o.channels = 1;
+        o.perClient = 1;
+    }
+    if (o.conns < 1 || o.channels < 1 || o.perClient < 0 || o.perClient > o.channels
+        || o.parallel < 1 || o.sources < 1 || o.sources > 254)
+        usage();
+    if (o.senders > o.conns)
+        o.senders = o.conns;
+}
+
+static void raiseFdLimit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if ((long)rl.rlim_cur < (long)g_opt.conns + 16)
+            std::fprintf(stderr, "warning: fd limit %ld is below %d connections\n",
+                         (long)rl.rlim_cur, g_opt.conns);
+    }
+}
+
+// Each client joins perClient distinct channels drawn uniformly or with
+// Zipf(1) weights, so a few channels end up large and most stay small.
+static void planMembership()
+{
+    std::vector<double> cdf(g_opt.channels);
+    double total = 0;
+    for (int i = 0; i < g_opt.channels; ++i)
+    {
+        total += g_opt.zipf ? 1.0 / (i + 1) : 1.0;
+        cdf[i] = total;
+    }
+    g_members.assign(g_opt.channels, 0);
+    g_conns.resize(g_opt.conns);
+    for (int c = 0; c < g_opt.conns; ++c)
+    {
+        Conn &cn = g_conns[c];
+        cn.fd = -1;
+        cn.state = DOWN;
+        cn.gen = 0;
+        cn.joined = 0;
+        cn.started = 0;
+        while ((int)cn.channels.size() < g_opt.perClient)
+        {
+            double r = (nextRand() / 4294967296.0) * total;
+            int ch = std::lower_bound(cdf.begin(), cdf.end(), r) - cdf.begin();
+            if (ch >= g_opt.channels)
+                ch = g_opt.channels - 1;
+            if (std::find(cn.channels.begin(), cn.channels.end(), ch) != cn.channels.end())
+                continue;
+            cn.channels.push_back(ch);
+            ++g_members[ch];
+        }
+    }
+}
+
+static void watch(int id, bool wantWrite)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    if (wantWrite)
+        ev.events |= EPOLLOUT;
+    ev.data.u32 = id;
+    epoll_ctl(g_epoll, EPOLL_CTL_MOD, g_conns[id].fd, &ev);
+}
+
+static void closeConn(int id)
+{
+    Conn &cn = g_conns[id];
+    if (cn.fd >= 0)
+        close(cn.fd);
+    if (cn.state == READY)
+        --g_ready;
+    cn.fd = -1;
+    cn.state = DOWN;
+    cn.in.clear();
+    cn.out.clear();
+}
+
+static void flushConn(int id)
+{
+    Conn &cn = g_conns[id];
+    while (!cn.out.empty())
+    {
+        ssize_t n = send(cn.fd, cn.out.data(), cn.out.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+        {
+            ++g_errors;
+            closeConn(id);
+            return;
+        }
+        cn.out.erase(0, n);
+    }
+    watch(id, !cn.out.empty() || cn.state == CONNECTING);
+}
+
+static void sendLine(int id, const std::string &line)
+{
+    Conn &cn = g_conns[id];
+    bool idle = cn.out.empty();
+    cn.out += line;
+    if (idle && cn.state != CONNECTING)
+        flushConn(id);
+}
+
+static void startConn(int id)
+{
+    Conn &cn = g_conns[id];
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        ++g_errors;
+        return;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (g_opt.sources > 1)
+    {
+        sockaddr_in src; std::memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(0x7f000001 + id % g_opt.sources);
+        bind(fd, (struct sockaddr*)&src, sizeof(src));
+    }
+
+    sockaddr_in addr; std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_opt.port);
+    inet_pton(AF_INET, g_opt.host, &addr.sin_addr);
+
+    cn.fd = fd;
+    cn.state = CONNECTING;
+    cn.joined = 0;
+    cn.started = nowNs();
+    ++cn.gen;
+
+    char buf[160];
+    std::snprintf(buf, sizeof(buf), "PASS %s\r\nNICK b%d_%u\r\nUSER b%d 0 * :ircbench\r\n",
+                  g_opt.password, id, cn.gen, id);
+    cn.out = buf;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u32 = id;
+    epoll_ctl(g_epoll, EPOLL_CTL_ADD, fd, &ev);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        ++g_errors;
+        closeConn(id);
+    }
+}
+
+static void joinChannels(int id)
+{
+    Conn &cn = g_conns[id];
+    if (cn.channels.empty())
+    {
+        cn.state = READY;
+        ++g_ready;
+        return;
+    }
+    cn.state = JOINING;
+    std::string line;
+    char buf[32];
+    for (size_t i = 0; i < cn.channels.size(); ++i)
+    {
+        std::snprintf(buf, sizeof(buf), "JOIN #c%d\r\n", cn.channels[i]);
+        line += buf;
+    }
+    sendLine(id, line);
+}
+
+static void handleLine(int id, const char *line, size_t len)
+{
+    Conn &cn = g_conns[id];
+    std::string l(line, len);
+
+    if (l.compare(0, 5, "PING ") == 0)
+    {
+        ++g_pings;
+        sendLine(id, "PONG " + l.substr(5) + "\r\n");
+        return;
+    }
+    std::string::size_type sp = l.find(' ');
+    if (sp == std::string::npos)
+        return;
+    std::string rest = l.substr(sp + 1);
+
+    if (rest.compare(0, 4, "001 ") == 0)
+    {
+        if (g_measuring || g_opt.scenario != STORM)
+            g_register.add(nowNs() - cn.started);
+        if (cn.gen > 1)
+            ++g_reconnects;
+        joinChannels(id);
+    }
+    else if (rest.compare(0, 4, "366 ") == 0)
+    {
+        if (cn.state == JOINING && ++cn.joined == cn.channels.size())
+        {
+            cn.state = READY;
+            ++g_ready;
+        }
+    }
+    else if (rest.compare(0, 8, "PRIVMSG ") == 0)
+    {
+        std::string::size_type t = rest.find(" :T");
+        if (t == std::string::npos || !g_measuring)
+            return;
+        unsigned long sentAt = std::strtoul(rest.c_str() + t + 3, 0, 10);
+        unsigned long now = nowNs();
+        g_fanout.add(now > sentAt ? now - sentAt : 0);
+        ++g_delivered;
+    }
+    else if (rest.compare(0, 4, "433 ") == 0 || l.compare(0, 6, "ERROR ") == 0)
+    {
+        ++g_errors;
+    }
+}
+
+static void readConn(int id)
+{
+    Conn &cn = g_conns[id];
+    char buf[65536];
+    while (cn.fd >= 0)
+    {
+        ssize_t n = recv(cn.fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+        {
+            ++g_errors;
+            closeConn(id);
+            return;
+        }
+        cn.in.append(buf, n);
+        size_t start = 0;
+        size_t nl;
+        while ((nl = cn.in.find('\n', start)) != std::string::npos)
+        {
+            size_t len = nl - start;
+            if (len && cn.in[nl - 1] == '\r')
+                --len;
+            handleLine(id, cn.in.data() + start, len);
+            if (cn.fd < 0)
+                return;
+            start = nl + 1;
+        }
+        cn.in.erase(0, start);
+    }
+}
+
+static void pollOnce(int timeoutMs)
+{
+    struct epoll_event evs[1024];
+    int n = epoll_wait(g_epoll, evs, 1024, timeoutMs);
+    for (int i = 0; i < n; ++i)
+    {
+        int id = evs[i].data.u32;
+        Conn &cn = g_conns[id];
+        if (cn.fd < 0)
+            continue;
+        if (cn.state == CONNECTING && (evs[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(cn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err)
+            {
+                ++g_errors;
+                closeConn(id);
+                continue;
+            }
+            cn.state = REGISTERING;
+        }
+        if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            readConn(id);
+        if (cn.fd >= 0 && (evs[i].events & EPOLLOUT))
+            flushConn(id);
+    }
+}
+
+static size_t settling()
+{
+    size_t n = 0;
+    for (size_t i = 0; i < g_conns.size(); ++i)
+        if (g_conns[i].state != DOWN && g_conns[i].state != READY)
+            ++n;
+    return n;
+}
+
+// Brings every connection up, at most `parallel` handshakes at a time so
+// the server's accept backlog is not overrun.
+static double setup()
+{
+    unsigned long t0 = nowNs();
+    size_t next = 0;
+    size_t inFlight = 0;
+    unsigned long lastProgress = t0;
+    unsigned long lastReady = 0;
+    while (g_ready < (unsigned long)g_opt.conns)
+    {
+        while (next < g_conns.size() && inFlight < (size_t)g_opt.parallel)
+        {
+            startConn(next++);
+            ++inFlight;
+        }
+        pollOnce(10);
+        inFlight = settling();
+        if (g_ready != lastReady)
+        {
+            lastReady = g_ready;
+            lastProgress = nowNs();
+        }
+        if (next == g_conns.size() && inFlight == 0)
+            break;
+        if (nowNs() - lastProgress > 10000000000UL)
+        {
+            std::fprintf(stderr, "setup stalled at %lu/%d ready\n", g_ready, g_opt.conns);
+            break;
+        }
+    }
+    return (nowNs() - t0) / 1e9;
+}
+
+static void sendMessage(int id)
+{
+    Conn &cn = g_conns[id];
+    if (cn.state != READY || cn.channels.empty())
+        return;
+    int ch = cn.channels[nextRand() % cn.channels.size()];
+    char head[64];
+    std::snprintf(head, sizeof(head), "PRIVMSG #c%d :T%lu ", ch, nowNs());
+    std::string line(head);
+    if ((int)line.size() < g_opt.payload + 12)
+        line.append(g_opt.payload + 12 - line.size(), 'x');
+    line += "\r\n";
+    sendLine(id, line);
+    ++g_sent;
+    g_expected += g_members[ch] - 1;
+}
+
+static void storm(int id)
+{
+    Conn &cn = g_conns[id];
+    if (cn.state != READY)
+        return;
+    sendLine(id, "QUIT :storm\r\n");
+    closeConn(id);
+    startConn(id);
+}
+
+static double run()
+{
+    unsigned long t0 = nowNs();
+    unsigned long end = t0 + (unsigned long)(g_opt.duration * 1e9);
+    unsigned long done = 0;
+    size_t cursor = 0;
+    g_measuring = true;
+
+    while (nowNs() < end)
+    {
+        pollOnce(1);
+        if (g_opt.scenario == IDLE)
+            continue;
+        double elapsed = (nowNs() - t0) / 1e9;
+        unsigned long due = (unsigned long)(elapsed * g_opt.rate);
+        size_t pool = g_opt.scenario == STORM ? g_conns.size() : (size_t)g_opt.senders;
+        for (size_t tries = 0; done < due && tries < pool * 2; ++tries)
+        {
+            int id = cursor++ % pool;
+            if (g_conns[id].state != READY)
+                continue;
+            if (g_opt.scenario == STORM)
+                storm(id);
+            else
+                sendMessage(id);
+            ++done;
+        }
+    }
+    double took = (nowNs() - t0) / 1e9;
+
+    unsigned long drainEnd = nowNs() + 2000000000UL;
+    while (nowNs() < drainEnd && g_delivered < g_expected)
+        pollOnce(10);
+    g_measuring = false;
+    return took;
+}
+
+static const char *scenarioName()
+{
+    switch (g_opt.scenario)
+    {
+        case HOT: return "hot";
+        case IDLE: return "idle";
+        case STORM: return "storm";
+        default: return "chat";
+    }
+}
+
+static void printLatency(const char *what, const LatencyHist &h)
+{
+    std::printf("%-9s n=%lu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", what, h.count(),
+                h.quantile(0.5) / 1e3, h.quantile(0.99) / 1e3, h.quantile(0.999) / 1e3,
+                h.max() / 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    parseOptions(argc, argv);
+    raiseFdLimit();
+    planMembership();
+    g_epoll = epoll_create(1024);
+    if (g_epoll < 0)
+    {
+        std::perror("epoll_create");
+        return 1;
+    }
+
+    std::printf("scenario=%s conns=%d channels=%d per_client=%d dist=%s senders=%d rate=%.0f/s\n",
+                scenarioName(), g_opt.conns, g_opt.channels, g_opt.perClient,
+                g_opt.zipf ? "zipf" : "uniform", g_opt.senders, g_opt.rate);
+
+    double setupTime = setup();
+    std::printf("setup     %lu/%d ready in %.2fs (%.0f conn/s)\n", g_ready, g_opt.conns,
+                setupTime, g_ready / (setupTime > 0 ? setupTime : 1));
+    printLatency("register", g_register);
+    if (g_opt.scenario == STORM)
+        g_register = LatencyHist();
+
+    double took = run();
+    switch (g_opt.scenario)
+    {
+        case IDLE:
+            std::printf("idle      %lu/%d still ready after %.1fs, %lu pings answered\n",
+                        g_ready, g_opt.conns, took, g_pings);
+            break;
+        case STORM:
+            std::printf("storm     %lu reconnects in %.1fs (%.0f/s)\n", g_reconnects, took,
+                        g_reconnects / took);
+            printLatency("reconnect", g_register);
+            break;
+        default:
+            std::printf("sent      %lu msgs in %.1fs (%.0f msg/s)\n", g_sent, took, g_sent / took);
+            std::printf("delivered %lu of %lu expected (%.0f msg/s)\n", g_delivered, g_expected,
+                        g_delivered / took);
+            printLatency("fanout", g_fanout);
+    }
+    std::printf("errors    %lu\n", g_errors);
+    return 0;
+}
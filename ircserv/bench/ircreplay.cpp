@@ -0,0 +1,639 @@
+// Replays a traffic capture (see Capture.hpp) against a server.
+//
+// Every captured connection gets its own socket, opened and fed at the
+// captured times divided by the speed factor, or as fast as the server
+// accepts them with -x max. PASS lines are rewritten to the given
+// password. Every Nth line on a registered connection is followed by a
+// PING probe whose PONG gives a processing latency; schedule lag is how
+// late lines left the replayer against the (scaled) capture clock.
+//
+// -o writes the summary as "key value" lines and -C compares the run
+// against such a file from an earlier build.
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <strings.h>
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "LatencyHist.hpp"
+
+static const char MAGIC[] = "IRCCAP1\n";
+
+enum
+{
+    TYPE_CONNECT = 1,
+    TYPE_LINE = 2,
+    TYPE_CLOSE = 3
+};
+
+struct Record
+{
+    unsigned long usec;
+    unsigned long id;
+    int type;
+    size_t off;
+    size_t len;
+};
+
+static bool byTime(const Record &a, const Record &b)
+{
+    return a.usec < b.usec;
+}
+
+struct Conn
+{
+    int fd;
+    bool connecting;
+    bool sentNick;
+    bool sentUser;
+    bool closing;
+    unsigned long lines;
+    unsigned long probes;
+    std::string in;
+    std::string out;
+};
+
+struct Options
+{
+    const char *file;
+    const char *host;
+    int port;
+    const char *password;
+    double speed;
+    int probeEvery;
+    double drain;
+    int parallel;
+    const char *output;
+    const char *compare;
+};
+
+static Options g_opt;
+static std::string g_data;
+static std::vector<Record> g_records;
+static std::vector<Conn> g_conns;
+static std::map<unsigned long, int> g_byId;
+static int g_epoll = -1;
+
+static size_t g_open = 0;
+static size_t g_connecting = 0;
+static size_t g_buffered = 0;
+static unsigned long g_linesSent = 0;
+static unsigned long g_bytesSent = 0;
+static unsigned long g_bytesRecv = 0;
+static unsigned long g_probes = 0;
+static unsigned long g_pongs = 0;
+static unsigned long g_lost = 0;
+static unsigned long g_errors = 0;
+static LatencyHist g_latency;
+static LatencyHist g_lag;
+
+static unsigned long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void usage()
+{
+    std::fprintf(stderr,
+        "usage: ircreplay [options] capture\n"
+        "  -H host -p port -w pass server and password (127.0.0.1 6667 pw)\n"
+        "  -x S                    speed factor, or max (1)\n"
+        "  -S N                    latency probe every N lines per connection (20)\n"
+        "  -T T                    seconds to wait for replies at the end (5)\n"
+        "  -P P                    connects in flight at max speed (64)\n"
+        "  -o file                 write results for a later -C\n"
+        "  -C file                 compare against earlier results\n");
+    std::exit(2);
+}
+
+static void parseOptions(int argc, char **argv)
+{
+    Options &o = g_opt;
+    o.file = 0;
+    o.host = "127.0.0.1";
+    o.port = 6667;
+    o.password = "pw";
+    o.speed = 1;
+    o.probeEvery = 20;
+    o.drain = 5;
+    o.parallel = 64;
+    o.output = 0;
+    o.compare = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "H:p:w:x:S:T:P:o:C:")) != -1)
+    {
+        switch (c)
+        {
+            case 'H': o.host = optarg; break;
+            case 'p': o.port = std::atoi(optarg); break;
+            case 'w': o.password = optarg; break;
+            case 'x': o.speed = std::strcmp(optarg, "max") == 0 ? 0 : std::atof(optarg); break;
+            case 'S': o.probeEvery = std::atoi(optarg); break;
+            case 'T': o.drain = std::atof(optarg); break;
+            case 'P': o.parallel = std::atoi(optarg); break;
+            case 'o': o.output = optarg; break;
+            case 'C': o.compare = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind != argc - 1 || o.speed < 0 || o.probeEvery < 0 || o.parallel < 1)
+        usage();
+    o.file = argv[optind];
+}
+
+static bool readVarint(size_t &pos, unsigned long &v)
+{
+    v = 0;
+    for (int shift = 0; pos < g_data.size() && shift < 64; shift += 7)
+    {
+        unsigned char b = g_data[pos++];
+        v |= (unsigned long)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static void load()
+{
+    FILE *f = std::fopen(g_opt.file, "rb");
+    if (!f)
+    {
+        std::perror(g_opt.file);
+        std::exit(1);
+    }
+    char buf[65536];
+    size_t n;
+    while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0)
+        g_data.append(buf, n);
+    std::fclose(f);
+
+    if (g_data.compare(0, sizeof(MAGIC) - 1, MAGIC) != 0)
+    {
+        std::fprintf(stderr, "%s: not a capture file\n", g_opt.file);
+        std::exit(1);
+    }
+    size_t pos = sizeof(MAGIC) - 1;
+    while (pos < g_data.size())
+    {
+        Record r;
+        r.type = (unsigned char)g_data[pos++];
+        r.off = 0;
+        r.len = 0;
+        unsigned long len = 0;
+        bool ok = readVarint(pos, r.usec) && readVarint(pos, r.id);
+        if (ok && r.type == TYPE_LINE)
+        {
+            ok = readVarint(pos, len) && len <= g_data.size() - pos;
+            r.off = pos;
+            r.len = len;
+            pos += len;
+        }
+        if (!ok || r.type < TYPE_CONNECT || r.type > TYPE_CLOSE)
+        {
+            std::fprintf(stderr, "%s: truncated or corrupt after %lu records\n", g_opt.file,
+                         (unsigned long)g_records.size());
+            break;
+        }
+        g_records.push_back(r);
+    }
+    std::stable_sort(g_records.begin(), g_records.end(), byTime);
+}
+
+static void raiseFdLimit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void watch(int idx, bool wantWrite)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    if (wantWrite)
+        ev.events |= EPOLLOUT;
+    ev.data.u32 = idx;
+    epoll_ctl(g_epoll, EPOLL_CTL_MOD, g_conns[idx].fd, &ev);
+}
+
+static void closeConn(int idx)
+{
+    Conn &cn = g_conns[idx];
+    if (cn.fd < 0)
+        return;
+    close(cn.fd);
+    cn.fd = -1;
+    --g_open;
+    if (cn.connecting)
+        --g_connecting;
+    g_lost += cn.probes;
+    cn.probes = 0;
+    g_buffered -= cn.out.size();
+    cn.out.clear();
+    cn.in.clear();
+}
+
+static void flushConn(int idx)
+{
+    Conn &cn = g_conns[idx];
+    while (!cn.out.empty())
+    {
+        ssize_t n = send(cn.fd, cn.out.data(), cn.out.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+        {
+            ++g_errors;
+            closeConn(idx);
+            return;
+        }
+        cn.out.erase(0, n);
+        g_buffered -= n;
+        g_bytesSent += n;
+    }
+    if (cn.out.empty() && cn.closing)
+        closeConn(idx);
+    else
+        watch(idx, !cn.out.empty() || cn.connecting);
+}
+
+static int openConn(unsigned long id)
+{
+    int idx = (int)g_conns.size();
+    g_conns.push_back(Conn());
+    Conn &cn = g_conns.back();
+    cn.fd = -1;
+    cn.connecting = true;
+    cn.sentNick = false;
+    cn.sentUser = false;
+    cn.closing = false;
+    cn.lines = 0;
+    cn.probes = 0;
+    g_byId[id] = idx;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        ++g_errors;
+        return idx;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockaddr_in addr; std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_opt.port);
+    inet_pton(AF_INET, g_opt.host, &addr.sin_addr);
+
+    cn.fd = fd;
+    ++g_open;
+    ++g_connecting;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u32 = idx;
+    epoll_ctl(g_epoll, EPOLL_CTL_ADD, fd, &ev);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        ++g_errors;
+        closeConn(idx);
+    }
+    return idx;
+}
+
+// The server handles a connection's lines in order, so once NICK and
+// USER are queued a probe behind them is answered as registered.
+static void queueProbe(int idx)
+{
+    Conn &cn = g_conns[idx];
+    if (cn.fd < 0 || cn.closing || !cn.sentNick || !cn.sentUser)
+        return;
+    char buf[48];
+    std::snprintf(buf, sizeof(buf), "PING :R%lu\r\n", nowNs());
+    size_t before = cn.out.size();
+    cn.out += buf;
+    g_buffered += cn.out.size() - before;
+    ++g_probes;
+    ++cn.probes;
+    if (before == 0 && !cn.connecting)
+        flushConn(idx);
+}
+
+// Connections already open when the capture started show up as lines
+// without a connect record; they are opened on first use.
+static int connFor(unsigned long id)
+{
+    std::map<unsigned long, int>::iterator it = g_byId.find(id);
+    return it != g_byId.end() ? it->second : openConn(id);
+}
+
+static void queueLine(int idx, const char *line, size_t len)
+{
+    Conn &cn = g_conns[idx];
+    if (cn.fd < 0 || cn.closing)
+        return;
+    size_t before = cn.out.size();
+    if (len > 5 && strncasecmp(line, "PASS ", 5) == 0)
+        cn.out += std::string("PASS ") + g_opt.password;
+    else
+        cn.out.append(line, len);
+    cn.out += "\r\n";
+    if (len > 5 && strncasecmp(line, "NICK ", 5) == 0)
+        cn.sentNick = true;
+    else if (len > 5 && strncasecmp(line, "USER ", 5) == 0)
+        cn.sentUser = true;
+    ++g_linesSent;
+    g_buffered += cn.out.size() - before;
+    if (before == 0 && !cn.connecting)
+        flushConn(idx);
+    if (g_opt.probeEvery && ++cn.lines % g_opt.probeEvery == 0)
+        queueProbe(idx);
+}
+
+static void apply(const Record &r)
+{
+    if (r.type == TYPE_CONNECT)
+    {
+        std::map<unsigned long, int>::iterator it = g_byId.find(r.id);
+        if (it == g_byId.end())
+            openConn(r.id);
+        return;
+    }
+    int idx = connFor(r.id);
+    if (r.type == TYPE_LINE)
+    {
+        queueLine(idx, g_data.data() + r.off, r.len);
+        return;
+    }
+    Conn &cn = g_conns[idx];
+    cn.closing = true;
+    if (cn.fd >= 0 && cn.out.empty() && !cn.connecting)
+        closeConn(idx);
+}
+
+static void handleLine(int idx, const char *line, size_t len)
+{
+    Conn &cn = g_conns[idx];
+    std::string l(line, len);
+
+    if (l.compare(0, 5, "PING ") == 0)
+    {
+        size_t before = cn.out.size();
+        cn.out += "PONG " + l.substr(5) + "\r\n";
+        g_buffered += cn.out.size() - before;
+        if (before == 0)
+            flushConn(idx);
+        return;
+    }
+    std::string::size_type sp = l.find(' ');
+    if (sp == std::string::npos)
+        return;
+    std::string rest = l.substr(sp + 1);
+
+    if (rest.compare(0, 5, "PONG ") == 0)
+    {
+        std::string::size_type t = rest.find(" :R");
+        if (t == std::string::npos)
+            return;
+        unsigned long sentAt = std::strtoul(rest.c_str() + t + 3, 0, 10);
+        unsigned long now = nowNs();
+        g_latency.add(now > sentAt ? now - sentAt : 0);
+        ++g_pongs;
+        if (cn.probes)
+            --cn.probes;
+    }
+}
+
+static void readConn(int idx)
+{
+    Conn &cn = g_conns[idx];
+    char buf[65536];
+    while (cn.fd >= 0)
+    {
+        ssize_t n = recv(cn.fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+        {
+            closeConn(idx);
+            return;
+        }
+        g_bytesRecv += n;
+        cn.in.append(buf, n);
+        size_t start = 0;
+        size_t nl;
+        while ((nl = cn.in.find('\n', start)) != std::string::npos)
+        {
+            size_t len = nl - start;
+            if (len && cn.in[nl - 1] == '\r')
+                --len;
+            handleLine(idx, cn.in.data() + start, len);
+            if (cn.fd < 0)
+                return;
+            start = nl + 1;
+        }
+        cn.in.erase(0, start);
+    }
+}
+
+static void pollOnce(int timeoutMs)
+{
+    struct epoll_event evs[1024];
+    int n = epoll_wait(g_epoll, evs, 1024, timeoutMs);
+    for (int i = 0; i < n; ++i)
+    {
+        int idx = evs[i].data.u32;
+        Conn &cn = g_conns[idx];
+        if (cn.fd < 0)
+            continue;
+        if (cn.connecting && (evs[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(cn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err)
+            {
+                ++g_errors;
+                closeConn(idx);
+                continue;
+            }
+            cn.connecting = false;
+            --g_connecting;
+        }
+        if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            readConn(idx);
+        if (cn.fd >= 0 && (evs[i].events & EPOLLOUT))
+            flushConn(idx);
+    }
+}
+
+// At max speed records are fed in batches, holding off while the
+// replayer itself has a large backlog the server has not taken yet or
+// too many connects are in flight for the accept backlog. The
+// run ends when a final probe on every live connection has come back,
+// so the time covers the server working through all of its input.
+static double replay()
+{
+    const size_t BATCH = 4096;
+    const size_t MAX_BUFFERED = 16 * 1024 * 1024;
+    unsigned long t0 = nowNs();
+    size_t next = 0;
+
+    while (next < g_records.size())
+    {
+        unsigned long now = nowNs();
+        size_t fed = 0;
+        while (next < g_records.size())
+        {
+            const Record &r = g_records[next];
+            unsigned long due = t0;
+            if (g_opt.speed > 0)
+                due += (unsigned long)(r.usec * 1000.0 / g_opt.speed);
+            if (due > now)
+                break;
+            if (g_opt.speed == 0 && (fed >= BATCH || g_buffered > MAX_BUFFERED
+                                     || (size_t)g_opt.parallel <= g_connecting))
+                break;
+            if (r.type == TYPE_LINE)
+                g_lag.add(now - due);
+            apply(r);
+            ++next;
+            ++fed;
+        }
+
+        int timeout = 0;
+        if (g_opt.speed > 0 && next < g_records.size())
+        {
+            unsigned long due = t0 + (unsigned long)(g_records[next].usec * 1000.0 / g_opt.speed);
+            now = nowNs();
+            timeout = due > now ? (int)((due - now) / 1000000) : 0;
+            if (timeout > 10)
+                timeout = 10;
+        }
+        pollOnce(timeout);
+    }
+    for (size_t i = 0; i < g_conns.size(); ++i)
+        queueProbe(i);
+
+    unsigned long drainEnd = nowNs() + (unsigned long)(g_opt.drain * 1e9);
+    while (nowNs() < drainEnd && (g_pongs + g_lost < g_probes || g_buffered > 0) && g_open > 0)
+        pollOnce(10);
+    return (nowNs() - t0) / 1e9;
+}
+
+typedef std::map<std::string, double> Results;
+
+static void writeResults(const Results &res)
+{
+    FILE *f = std::fopen(g_opt.output, "w");
+    if (!f)
+    {
+        std::perror(g_opt.output);
+        return;
+    }
+    for (Results::const_iterator it = res.begin(); it != res.end(); ++it)
+        std::fprintf(f, "%s %.3f\n", it->first.c_str(), it->second);
+    std::fclose(f);
+}
+
+static void compareResults(const Results &res)
+{
+    FILE *f = std::fopen(g_opt.compare, "r");
+    if (!f)
+    {
+        std::perror(g_opt.compare);
+        return;
+    }
+    Results base;
+    char key[64];
+    double value;
+    while (std::fscanf(f, "%63s %lf", key, &value) == 2)
+        base[key] = value;
+    std::fclose(f);
+
+    std::printf("\n%-20s %14s %14s %9s\n", "metric", "baseline", "this run", "change");
+    for (Results::const_iterator it = res.begin(); it != res.end(); ++it)
+    {
+        Results::const_iterator b = base.find(it->first);
+        if (b == base.end())
+            continue;
+        double change = b->second ? (it->second - b->second) * 100 / b->second : 0;
+        std::printf("%-20s %14.1f %14.1f %+8.1f%%\n", it->first.c_str(), b->second,
+                    it->second, change);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    parseOptions(argc, argv);
+    load();
+    raiseFdLimit();
+    g_epoll = epoll_create(1024);
+    if (g_epoll < 0)
+    {
+        std::perror("epoll_create");
+        return 1;
+    }
+
+    unsigned long span = g_records.empty() ? 0 : g_records.back().usec;
+    char speed[32] = "max";
+    if (g_opt.speed > 0)
+        std::snprintf(speed, sizeof(speed), "%gx", g_opt.speed);
+    std::printf("capture   %lu records over %.2fs, speed %s\n",
+                (unsigned long)g_records.size(), span / 1e6, speed);
+
+    double took = replay();
+    double secs = took > 0 ? took : 1;
+    std::printf("replayed  %lu lines on %lu connections in %.2fs (%.0f lines/s)\n",
+                g_linesSent, (unsigned long)g_conns.size(), took, g_linesSent / secs);
+    std::printf("bytes     %lu sent, %lu received (%.0f KiB/s in)\n", g_bytesSent, g_bytesRecv,
+                g_bytesRecv / secs / 1024);
+    std::printf("latency   n=%lu/%lu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", g_pongs,
+                g_probes, g_latency.quantile(0.5) / 1e3, g_latency.quantile(0.99) / 1e3,
+                g_latency.quantile(0.999) / 1e3, g_latency.max() / 1e3);
+    std::printf("lag       p50=%.1fus p99=%.1fus max=%.1fus\n", g_lag.quantile(0.5) / 1e3,
+                g_lag.quantile(0.99) / 1e3, g_lag.max() / 1e3);
+    std::printf("errors    %lu\n", g_errors);
+
+    Results res;
+    res["lines_per_sec"] = g_linesSent / secs;
+    res["recv_kib_per_sec"] = g_bytesRecv / secs / 1024;
+    res["latency_p50_us"] = g_latency.quantile(0.5) / 1e3;
+    res["latency_p99_us"] = g_latency.quantile(0.99) / 1e3;
+    res["latency_p999_us"] = g_latency.quantile(0.999) / 1e3;
+    res["lag_p99_us"] = g_lag.quantile(0.99) / 1e3;
+    res["probes_lost"] = g_lost;
+    res["errors"] = g_errors;
+    if (g_opt.output)
+        writeResults(res);
+    if (g_opt.compare)
+        compareResults(res);
+
+    for (size_t i = 0; i < g_conns.size(); ++i)
+        closeConn(i);
+    return 0;
+}
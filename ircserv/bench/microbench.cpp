@@ -0,0 +1,470 @@
+// Hot-path microbenchmarks.
+//
+// Drives the per-line code directly, without an event loop: input line
+// extraction, parsing, command dispatch, channel broadcast and NAMES/WHO
+// reply building. Clients sit on socketpairs whose far ends are drained
+// between batches, outside the timed region. Global operator new is
+// replaced with a counting hook, so every row also reports heap
+// allocations per operation.
+//
+// A second table compares channel membership layouts at 10, 1k and 50k
+// members: the flat MemberTable against the std::set trees it replaced,
+// by memory per member, a full walk and a membership lookup.
+//
+// usage: microbench [members] [seconds per case]
+
+#include "../Server.hpp"
+#include "../Commands.hpp"
+#include "../IrcMessage.hpp"
+#include "../MemberTable.hpp"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <set>
+#include <string>
+#include <vector>
+
+static unsigned long s_allocs = 0;
+static unsigned long s_allocBytes = 0;
+static unsigned long s_liveBytes = 0;
+
+// Each block carries its size in a 16 byte header so live bytes can be
+// tracked through delete.
+void *operator new(std::size_t size) throw(std::bad_alloc)
+{
+    ++s_allocs;
+    s_allocBytes += size;
+    s_liveBytes += size;
+    char *p = static_cast<char*>(std::malloc(size + 16));
+    if (!p)
+        throw std::bad_alloc();
+    *reinterpret_cast<std::size_t*>(p) = size;
+    return p + 16;
+}
+
+void *operator new[](std::size_t size) throw(std::bad_alloc)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) throw()
+{
+    if (!p)
+        return;
+    char *block = static_cast<char*>(p) - 16;
+    s_liveBytes -= *reinterpret_cast<std::size_t*>(block);
+    std::free(block);
+}
+
+void operator delete[](void *p) throw()
+{
+    std::free(p);
+}
+
+static double nowSec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Accumulates time and allocations over the timed parts of a case.
+struct Meter
+{
+    const char *name;
+    unsigned long ops;
+    double sec;
+    unsigned long allocs;
+    unsigned long bytes;
+    double t0;
+    unsigned long a0;
+    unsigned long b0;
+
+    explicit Meter(const char *n)
+    : name(n), ops(0), sec(0), allocs(0), bytes(0), t0(0), a0(0), b0(0) {}
+
+    void start()
+    {
+        a0 = s_allocs;
+        b0 = s_allocBytes;
+        t0 = nowSec();
+    }
+
+    void stop(unsigned long n)
+    {
+        sec += nowSec() - t0;
+        allocs += s_allocs - a0;
+        bytes += s_allocBytes - b0;
+        ops += n;
+    }
+
+    void report() const
+    {
+        double per = ops ? (double)ops : 1.0;
+        std::printf("%-24s %12lu %12.1f %12.2f %12.1f\n", name, ops,
+                    sec * 1e9 / per, allocs / per, bytes / per);
+    }
+};
+
+struct Member
+{
+    Client *client;
+    int peer;
+};
+
+static Member makeMember(Server &server, const std::string &nick)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        std::perror("socketpair");
+        std::exit(1);
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    Member m;
+    m.client = new Client(fds[0], 0, server.nextClientId());
+    m.peer = fds[1];
+    server.renameClient(*m.client, nick);
+    m.client->setUsername(nick);
+    m.client->setPassOk(true);
+    m.client->markRegistered();
+    m.client->authenticate();
+    return m;
+}
+
+static void join(Channel *ch, Member &m)
+{
+    ch->addClient(m.client);
+    m.client->addChannel(ch);
+}
+
+static void drain(Member &m)
+{
+    static char buf[65536];
+    while (m.client->hasPending())
+    {
+        m.client->flushSend();
+        while (recv(m.peer, buf, sizeof(buf), 0) > 0)
+            ;
+    }
+}
+
+static void drainAll(std::vector<Member> &members)
+{
+    for (size_t i = 0; i < members.size(); ++i)
+        drain(members[i]);
+}
+
+static void benchExtract(double budget)
+{
+    Meter meter("extractLine");
+    const char line[] = "PRIVMSG #bench :the quick brown fox jumps over the lazy dog\r\n";
+    size_t len = sizeof(line) - 1;
+    Client c(-1, 0, 0);
+
+    while (meter.sec < budget)
+    {
+        InputBuffer &in = c.getInput();
+        unsigned long n = 0;
+        while (in.writable() >= len)
+        {
+            std::memcpy(in.writePtr(), line, len);
+            in.commit(len);
+            ++n;
+        }
+        Slice s;
+        meter.start();
+        while (c.extractLine(s) == InputBuffer::LINE_READY)
+            ;
+        meter.stop(n);
+    }
+    meter.report();
+}
+
+static void benchParse(double budget)
+{
+    Meter meter("parseMessage");
+    const char text[] = ":nick!user@host PRIVMSG #bench :the quick brown fox";
+    Slice line(text, sizeof(text) - 1);
+    const unsigned long batch = 10000;
+
+    while (meter.sec < budget)
+    {
+        meter.start();
+        for (unsigned long i = 0; i < batch; ++i)
+        {
+            IrcMessage msg;
+            parseMessage(line, msg);
+        }
+        meter.stop(batch);
+    }
+    meter.report();
+}
+
+// Parse plus dispatch of one line from `from`; replies are drained
+// between batches.
+static void benchDispatch(const char *name, Server &server, Member &from,
+                          std::vector<Member> &members, const std::string &text,
+                          unsigned long batch, double budget)
+{
+    Meter meter(name);
+    Slice line(text.data(), text.size());
+
+    while (meter.sec < budget)
+    {
+        meter.start();
+        for (unsigned long i = 0; i < batch; ++i)
+        {
+            IrcMessage msg;
+            if (parseMessage(line, msg))
+                Commands::dispatch(server, *from.client, msg);
+        }
+        meter.stop(batch);
+        drain(from);
+        drainAll(members);
+    }
+    meter.report();
+}
+
+static void benchBroadcast(Channel *ch, std::vector<Member> &members, double budget)
+{
+    Meter meter("broadcast");
+    SharedBuffer message(":nick!user@host PRIVMSG #big :the quick brown fox\r\n");
+    const unsigned long batch = 64;
+
+    while (meter.sec < budget)
+    {
+        meter.start();
+        for (unsigned long i = 0; i < batch; ++i)
+            ch->broadcast(message);
+        meter.stop(batch);
+        drainAll(members);
+    }
+    meter.report();
+}
+
+// The pre-MemberTable layout: one tree per mode. The server used a pool
+// allocator with the same node size, so heap bytes here match its slabs.
+struct SetChannel
+{
+    std::set<Client*> clients;
+    std::set<Client*> operators;
+    std::set<Client*> invited;
+};
+
+struct LayoutResult
+{
+    double bytes;
+    double walkNs;
+    double lookupNs;
+};
+
+// Fake, never dereferenced client addresses at Client-sized strides,
+// joined in shuffled order as on a long-running server.
+static std::vector<Client*> fakeClients(size_t n)
+{
+    std::vector<Client*> out(n);
+    for (size_t i = 0; i < n; ++i)
+        out[i] = reinterpret_cast<Client*>(0x100000UL + i * sizeof(Client));
+    unsigned long x = 88172645463325252UL;
+    for (size_t i = n; i > 1; --i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        std::swap(out[i - 1], out[x % i]);
+    }
+    return out;
+}
+
+static LayoutResult measureSets(const std::vector<Client*> &clients, size_t size,
+                                size_t channels, double budget)
+{
+    LayoutResult r;
+    unsigned long before = s_liveBytes;
+    std::vector<SetChannel*> chans;
+    for (size_t k = 0; k < channels; ++k)
+    {
+        SetChannel *ch = new SetChannel;
+        for (size_t i = 0; i < size; ++i)
+            ch->clients.insert(clients[(k * size + i) % clients.size()]);
+        ch->operators.insert(*ch->clients.begin());
+        chans.push_back(ch);
+    }
+    double members = (double)size * channels;
+    r.bytes = (s_liveBytes - before) / members;
+
+    unsigned long sink = 0;
+    unsigned long passes = 0;
+    double t0 = nowSec();
+    do
+    {
+        for (size_t k = 0; k < channels; ++k)
+        {
+            const std::set<Client*> &set = chans[k]->clients;
+            for (std::set<Client*>::const_iterator it = set.begin(); it != set.end(); ++it)
+                sink += reinterpret_cast<unsigned long>(*it);
+        }
+        ++passes;
+    } while (nowSec() - t0 < budget);
+    r.walkNs = (nowSec() - t0) * 1e9 / (members * passes);
+
+    unsigned long lookups = 0;
+    t0 = nowSec();
+    do
+    {
+        for (size_t k = 0; k < channels; ++k)
+        {
+            for (size_t i = 0; i < size; i += 7)
+            {
+                sink += chans[k]->clients.count(clients[(k * size + i) % clients.size()]);
+                ++lookups;
+            }
+        }
+    } while (nowSec() - t0 < budget);
+    r.lookupNs = (nowSec() - t0) * 1e9 / lookups;
+
+    for (size_t k = 0; k < channels; ++k)
+        delete chans[k];
+    if (sink == 42)
+        std::printf(" ");
+    return r;
+}
+
+static LayoutResult measureTable(const std::vector<Client*> &clients, size_t size,
+                                 size_t channels, double budget)
+{
+    LayoutResult r;
+    unsigned long before = s_liveBytes;
+    std::vector<MemberTable*> chans;
+    for (size_t k = 0; k < channels; ++k)
+    {
+        MemberTable *t = new MemberTable;
+        for (size_t i = 0; i < size; ++i)
+            t->join(clients[(k * size + i) % clients.size()]);
+        t->set(t->members()[0].client, MemberTable::OP);
+        chans.push_back(t);
+    }
+    double members = (double)size * channels;
+    r.bytes = (s_liveBytes - before) / members;
+
+    unsigned long sink = 0;
+    unsigned long passes = 0;
+    double t0 = nowSec();
+    do
+    {
+        for (size_t k = 0; k < channels; ++k)
+        {
+            const Membership *m = chans[k]->members();
+            for (size_t i = 0, n = chans[k]->memberCount(); i < n; ++i)
+                sink += reinterpret_cast<unsigned long>(m[i].client);
+        }
+        ++passes;
+    } while (nowSec() - t0 < budget);
+    r.walkNs = (nowSec() - t0) * 1e9 / (members * passes);
+
+    unsigned long lookups = 0;
+    t0 = nowSec();
+    do
+    {
+        for (size_t k = 0; k < channels; ++k)
+        {
+            for (size_t i = 0; i < size; i += 7)
+            {
+                sink += chans[k]->modes(clients[(k * size + i) % clients.size()]) & MemberTable::MEMBER;
+                ++lookups;
+            }
+        }
+    } while (nowSec() - t0 < budget);
+    r.lookupNs = (nowSec() - t0) * 1e9 / lookups;
+
+    for (size_t k = 0; k < channels; ++k)
+        delete chans[k];
+    if (sink == 42)
+        std::printf(" ");
+    return r;
+}
+
+// About 100k memberships per size, spread over as many channels as that
+// takes.
+static void benchLayouts(double budget)
+{
+    static const size_t sizes[] = { 10, 1000, 50000 };
+    std::vector<Client*> clients = fakeClients(50000);
+
+    std::printf("\n%-10s %-12s %14s %14s %14s\n", "members", "layout",
+                "bytes/member", "walk ns/member", "lookup ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        size_t channels = 100000 / sizes[s];
+        LayoutResult sets = measureSets(clients, sizes[s], channels, budget);
+        LayoutResult table = measureTable(clients, sizes[s], channels, budget);
+        std::printf("%-10lu %-12s %14.1f %14.2f %14.1f\n", (unsigned long)sizes[s],
+                    "std::set", sets.bytes, sets.walkNs, sets.lookupNs);
+        std::printf("%-10lu %-12s %14.1f %14.2f %14.1f\n", (unsigned long)sizes[s],
+                    "MemberTable", table.bytes, table.walkNs, table.lookupNs);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? (size_t)std::atoi(argv[1]) : 500;
+    double budget = argc > 2 ? std::atof(argv[2]) : 0.5;
+    if (count < 2)
+        count = 2;
+
+    Server server(0, "");
+    Channel *big = server.getChannel("#big");
+    std::vector<Member> members;
+    char nick[32];
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::snprintf(nick, sizeof(nick), "user%lu", (unsigned long)i);
+        members.push_back(makeMember(server, nick));
+        join(big, members.back());
+    }
+    big->addOperator(members[0].client);
+
+    Channel *small = server.getChannel("#small");
+    for (size_t i = 0; i < 10 && i < count; ++i)
+        join(small, members[i]);
+
+    Member &me = members[0];
+
+    std::printf("%lu members in #big, 10 in #small, %.2f s per case\n",
+                (unsigned long)count, budget);
+    std::printf("%-24s %12s %12s %12s %12s\n", "case", "ops", "ns/op", "allocs/op", "bytes/op");
+
+    benchExtract(budget);
+    benchParse(budget);
+    benchDispatch("dispatch PING", server, me, members, "PING :token", 1000, budget);
+    benchDispatch("dispatch PRIVMSG #small", server, me, members,
+                  "PRIVMSG #small :the quick brown fox", 1000, budget);
+    benchDispatch("dispatch PRIVMSG #big", server, me, members,
+                  "PRIVMSG #big :the quick brown fox", 64, budget);
+    benchDispatch("dispatch PRIVMSG nick", server, me, members,
+                  "PRIVMSG user1 :the quick brown fox", 1000, budget);
+    benchDispatch("dispatch PRIVMSG 4 tgts", server, me, members,
+                  "PRIVMSG #small,user1,user2,user12 :the quick brown fox", 1000, budget);
+    benchBroadcast(big, members, budget);
+    benchDispatch("NAMES #big", server, me, members, "NAMES #big", 16, budget);
+    benchDispatch("WHO #big", server, me, members, "WHO #big", 16, budget);
+    benchLayouts(budget);
+
+    server.destroyChannel(big);
+    server.destroyChannel(small);
+    for (size_t i = 0; i < members.size(); ++i)
+    {
+        close(members[i].peer);
+        close(members[i].client->getFd());
+        delete members[i].client;
+    }
+    return 0;
+}
@@ -0,0 +1,136 @@
+// Slow-reader send queue benchmark.
+//
+// Queues a multi-megabyte backlog of IRC lines on one end of a socketpair
+// and drains the other end a few KiB at a time, the way a stalled client
+// would. Only the time spent in the flush path is measured. The "string"
+// variant is the previous Client outbox (append + send + erase(0, n)); the
+// "chunked" variant is the current Client::flushSend.
+
+#include "../Client.hpp"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+static double nowSec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void makePair(int fds[2], int bufSize)
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        std::perror("socketpair");
+        std::exit(1);
+    }
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+}
+
+static size_t drain(int fd, size_t chunk)
+{
+    static char buf[65536];
+    if (chunk > sizeof(buf))
+        chunk = sizeof(buf);
+    ssize_t n = recv(fd, buf, chunk, 0);
+    return n > 0 ? (size_t)n : 0;
+}
+
+struct Result
+{
+    double flushSec;
+    unsigned long calls;
+};
+
+static Result runString(const std::string &line, size_t lines, size_t readChunk, int bufSize)
+{
+    int fds[2];
+    makePair(fds, bufSize);
+
+    std::string outbox;
+    for (size_t i = 0; i < lines; ++i)
+        outbox += line;
+
+    Result r = { 0.0, 0 };
+    size_t received = 0, total = outbox.size();
+    while (received < total)
+    {
+        double t0 = nowSec();
+        while (!outbox.empty())
+        {
+            ssize_t n = send(fds[0], outbox.data(), outbox.size(), MSG_DONTWAIT);
+            ++r.calls;
+            if (n <= 0)
+                break;
+            outbox.erase(0, (size_t)n);
+        }
+        r.flushSec += nowSec() - t0;
+        received += drain(fds[1], readChunk);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return r;
+}
+
+static Result runChunked(const std::string &line, size_t lines, size_t readChunk, int bufSize)
+{
+    int fds[2];
+    makePair(fds, bufSize);
+
+    Client c(fds[0]);
+    for (size_t i = 0; i < lines; ++i)
+        c.queueSend(SharedBuffer(line));
+
+    Result r = { 0.0, 0 };
+    size_t received = 0, total = line.size() * lines;
+    while (received < total)
+    {
+        double t0 = nowSec();
+        if (c.hasPending())
+        {
+            c.flushSend();
+            ++r.calls;
+        }
+        r.flushSec += nowSec() - t0;
+        received += drain(fds[1], readChunk);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    size_t backlogMb = argc > 1 ? (size_t)std::atoi(argv[1]) : 4;
+    size_t readChunk = argc > 2 ? (size_t)std::atoi(argv[2]) : 4096;
+    int bufSize = 16384;
+
+    std::string line = ":nick!user@host PRIVMSG #bench :"
+                       + std::string(80, 'x') + "\r\n";
+    size_t lines = backlogMb * 1024 * 1024 / line.size();
+
+    std::printf("backlog %lu MiB, %lu lines of %lu bytes, reader takes %lu bytes per round\n",
+                (unsigned long)backlogMb, (unsigned long)lines,
+                (unsigned long)line.size(), (unsigned long)readChunk);
+
+    Result a = runString(line, lines, readChunk, bufSize);
+    Result b = runChunked(line, lines, readChunk, bufSize);
+
+    std::printf("%-10s %12s %12s %14s\n", "outbox", "flush ms", "flushes", "ns/byte");
+    std::printf("%-10s %12.2f %12lu %14.2f\n", "string", a.flushSec * 1e3, a.calls,
+                a.flushSec * 1e9 / (line.size() * lines));
+    std::printf("%-10s %12.2f %12lu %14.2f\n", "chunked", b.flushSec * 1e3, b.calls,
+                b.flushSec * 1e9 / (line.size() * lines));
+    if (b.flushSec > 0)
+        std::printf("speedup    %.1fx\n", a.flushSec / b.flushSec);
+    return 0;
+}
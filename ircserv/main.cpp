@@ -14,6 +14,25 @@ void handleSig(int)
     }
 }
 
+void handleUpgrade(int)
+{
+    if (g_server)
+    {
+        std::cout << "\n[Server] Upgrading..." << std::endl;
+        g_server->requestUpgrade();
+    }
+}
+
+static void logPools()
+{
+    std::vector<PoolStats> pools;
+    Pool::collect(pools);
+    for (size_t i = 0; i < pools.size(); ++i)
+        std::cout << "[Server] Pool " << pools[i].name << "/" << pools[i].objectSize
+                  << ": live=" << pools[i].live << " free=" << pools[i].free
+                  << " slabs=" << pools[i].slabs << std::endl;
+}
+
 int main(int argc, char **argv)
 {
     if (argc != 3)
@@ -24,16 +43,45 @@ int main(int argc, char **argv)
 
     int port = std::atoi(argv[1]);
     std::string pass = argv[2];
+    const char *backend = std::getenv("IRCSERV_POLLER");
+    const char *threads = std::getenv("IRCSERV_THREADS");
+    const char *prealloc = std::getenv("IRCSERV_PREALLOC");
+    if (prealloc)
+        Client::pool().reserve(std::strtoul(prealloc, 0, 10));
+
+    const char *configPath = std::getenv("IRCSERV_CONFIG");
+
+    Config config;
+    try
+    {
+        if (configPath)
+            config.load(configPath);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Fatal: " << e.what() << std::endl;
+        return 2;
+    }
 
-    Server srv(port, pass);
+    Server srv(port, pass, config, backend ? backend : "", threads ? std::atoi(threads) : 1);
     g_server = &srv;
     std::signal(SIGINT, handleSig);
     std::signal(SIGTERM, handleSig);
+    std::signal(SIGUSR2, handleUpgrade);
+    srv.enableUpgrade(argv);
 
     try
     {
-        srv.start();
+        if (const char *upgradeFd = std::getenv("IRCSERV_UPGRADE_FD"))
+        {
+            int fd = std::atoi(upgradeFd);
+            unsetenv("IRCSERV_UPGRADE_FD");
+            srv.adopt(fd);
+        }
+        else
+            srv.start();
         srv.run();
+        logPools();
     }
     catch (const std::exception &e)
     {